@@ -6,8 +6,14 @@ import subprocess
 import sys
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_aligned_alloc', 'mm_arena_stats', 'mm_calloc',
+                   'mm_checkheap', 'mm_free', 'mm_free_batch', 'mm_init',
+                   'mm_malloc', 'mm_malloc_batch', 'mm_malloc_hint',
+                   'mm_memalign', 'mm_posix_memalign', 'mm_profile_dump',
+                   'mm_profile_signal', 'mm_profile_start', 'mm_profile_stop',
+                   'mm_realloc', 'mm_region_alloc', 'mm_region_create',
+                   'mm_region_destroy', 'mm_region_reset', 'mm_stats',
+                   'mm_trim', 'mm_usable_size']
 
 
 MINUTIL = 60
@@ -10,20 +10,32 @@
  * WARNING! This file has been heavily modified compared to the original.
  */
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#ifdef THREADS
+#include <pthread.h>
+#endif
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -37,6 +49,37 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Latency histograms keep LAT_SUB buckets for every power of two, HDR style,
+   so each bucket is within 1/LAT_SUB of the values it counts */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB + (64 - LAT_SUB_BITS) * LAT_SUB)
+
+/* Hardware and software events counted by perf_event_open */
+#define N_COUNTERS 7
+
+/* Most threads replaying a trace at once and the most thread counts tried */
+#define MAX_THREADS 64
+#define MAX_STEPS 8
+
+/* Blocks passed between threads, in slots per thread */
+#define MAILBOX_SIZE 1024
+
+/* Walks of the locality mode read a byte of every line of the payloads and
+   count the pages they are in */
+#define WALK_LINE 64
+#define WALK_PAGE 4096
+
+/* Hints of allocations (set by -H), other hints are ids of blocks to put the
+   new one next to */
+#define HINT_SHORT -2
+#define HINT_LONG -1
+
+/* Output formats of the results (set by -F) */
+#define FMT_TEXT 0
+#define FMT_JSON 1
+#define FMT_CSV 2
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -62,13 +105,6 @@ typedef struct range_t {
   int index;            /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
   char filename[MAXLINE];
@@ -77,6 +113,8 @@ typedef struct {
   int num_ops;          /* number of distinct requests */
   int weight;           /* weight for this trace (unused) */
   traceop_t *ops;       /* array of requests */
+  int *hints;           /* hint of every allocation (set by -H), or NULL */
+  size_t mapped;        /* length of the mapping of a binary trace, or 0 */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
@@ -90,8 +128,67 @@ typedef struct {
 typedef struct {
   trace_t *trace;
   range_t *ranges;
+  struct latency_t *latency; /* filled by the xxx_latency functions */
 } speed_t;
 
+/* Latencies of one type of request in nanoseconds */
+typedef struct {
+  unsigned long count;
+  unsigned long max;
+  double sum;
+  unsigned long buckets[LAT_BUCKETS];
+} hist_t;
+
+/* Latencies of all requests in one run of a trace */
+typedef struct latency_t {
+  hist_t ops[3]; /* indexed by the request type */
+} latency_t;
+
+/* Values of the counters in one run of a trace, -1 if a counter is missing */
+typedef struct {
+  double values[N_COUNTERS];
+} counters_t;
+
+/* Walks of the live blocks in the locality mode */
+typedef struct {
+  int walks;        /* number of walks, one after every phase */
+  double blocks;    /* blocks visited by all walks */
+  double ns;        /* time of all walks, the best of -k runs of each */
+  double pages;     /* distinct pages the payloads of each walk were in */
+  double min_pages; /* ... and the fewest pages they would fit in */
+} locality_t;
+
+/* Results of the trace replayed by some number of threads at once */
+typedef struct {
+  int threads;      /* number of threads */
+  double secs;      /* time of the best run, or -1 if it ran out of memory */
+  size_t locks;     /* arena locks taken in that run */
+  size_t contended; /* ... of which were held by another thread */
+  size_t remote;    /* blocks freed through the stacks of remote frees */
+} scaling_t;
+
+#ifdef THREADS
+/* Ring of blocks one thread passes to the next one to be freed there, with
+   a single producer and a single consumer */
+typedef struct {
+  void *slots[MAILBOX_SIZE];
+  unsigned long head __attribute__((aligned(64))); /* next slot to be freed */
+  unsigned long tail __attribute__((aligned(64))); /* next slot to be filled */
+} mailbox_t;
+
+/* State of one thread replaying the trace in the threads mode */
+typedef struct {
+  trace_t trace;             /* the trace with blocks arrays of its own */
+  mailbox_t *inbox;          /* blocks this thread has to free */
+  mailbox_t *outbox;         /* blocks passed to the next thread */
+  pthread_barrier_t *start;  /* all threads start replaying at once */
+  pthread_barrier_t *done;   /* no more blocks are passed after it */
+  unsigned seed;             /* picks the frees passed to the next thread */
+  int failed;                /* the allocator ran out of memory */
+  uint64_t begin, end;       /* when the thread started and finished */
+} replayer_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
   /* set in read_trace */
@@ -108,6 +205,22 @@ typedef struct {
   int used;    /* maximum bytes used by allocated blocks */
   int total;   /* total heap size */
 
+  /* defined only in the latency mode */
+  latency_t latency; /* latencies of the run with the lowest p99 */
+
+  /* defined only with the performance counters */
+  counters_t counters; /* counters of the run with the fewest cycles */
+
+  /* defined only in the threads mode */
+  scaling_t scaling[MAX_STEPS]; /* 1, 2, 4, ... threads up to -T */
+  int num_steps;
+
+  /* defined only with the heap statistics */
+  struct mm_stats heap; /* statistics at the peak of live bytes */
+
+  /* defined only in the locality mode */
+  locality_t locality; /* walks of the live blocks after every phase */
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -132,6 +245,42 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
 static int verbose = 1; /* global flag for verbose output */
 
+static int latency_mode = 0; /* time every request (set by -L) */
+static int repeats = 1;      /* timed runs of each trace (set by -k) */
+static int counters_mode = 0; /* count hardware events (set by -P) */
+static int threads = 0;       /* replay threads, at most (set by -T) */
+static int remote_pct = 0;    /* frees passed to another thread (set by -x) */
+static int heap_mode = 0;     /* read the heap statistics (set by -S) */
+static long profile_rate = 0; /* mean bytes between samples (set by -p) */
+static int walk_phases = 0;   /* walks of the live blocks (set by -w) */
+static long hint_ops = 0;     /* lifetime of short-lived blocks (set by -H) */
+static volatile char walk_sink; /* keeps the reads of the walks */
+
+/* Events counted in the counters mode, the first one picks the best run */
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} events[N_COUNTERS] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"L1d-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"LLC-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"dTLB-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"br-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+static int counter_fds[N_COUNTERS]; /* -1 if the system can't count it */
+
+/* Names of the request types, indexed like the latency histograms */
+static const char *request_names[] = {"malloc", "free", "realloc"};
+
 /*********************
  * Function prototypes
  *********************/
@@ -148,7 +297,13 @@ static void check_index(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
+static void add_tracefile(char ***files, int *n, char *filename);
+static void add_tracedir(char ***files, int *n, const char *dirname);
 static trace_t *read_trace(stats_t *stats, const char *filename);
+static void map_trace(trace_t *trace, FILE *tracefile);
+static void check_trace(trace_t *trace);
+static void write_trace(trace_t *trace, const char *filename);
+static void hint_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -159,11 +314,23 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
+static double eval_mm_util(trace_t *trace, int *used_p, int *total_p,
+                           struct mm_stats *peak);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(void *ptr);
+static void eval_libc_latency(void *ptr);
+static void eval_mm_threads(trace_t *trace, stats_t *stats);
+static void eval_locality(trace_t *trace, locality_t *loc, int libc);
 
 /* Various helper routines */
-static void printresults(stats_t *stats);
+static void printresults(stats_t *stats, int n);
+static void printlatency(stats_t *stats);
+static void printcounters(stats_t *stats);
+static void printscaling(stats_t *stats);
+static void printheap(stats_t *stats);
+static void printlocality(stats_t *stats);
+static void printjson(stats_t *stats, int n);
+static void printcsv(stats_t *stats, int n);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
@@ -192,49 +359,283 @@ static double fsecs(fsecs_test_funct f, void *argp) {
   return (1E-3 * diff);
 }
 
-/* Run the tests; return the number of tests run (may be less than
-   num_tracefiles, if there's a timeout) */
-static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
+/*
+ * fsecs_best - Run f once to warm up if it is repeated, then repeats times.
+ *    Return the shortest running time.
+ */
+static double fsecs_best(fsecs_test_funct f, void *argp) {
+  double best = DBL_MAX;
+
+  if (repeats > 1)
+    f(argp);
+
+  for (int k = 0; k < repeats; k++) {
+    double secs = fsecs(f, argp);
+    best = (secs < best) ? secs : best;
+  }
+  return best;
+}
+
+/***********************
+ * Per-request latencies
+ ***********************/
+
+/* timestamp - Nanoseconds from a clock not adjusted by NTP */
+static inline uint64_t timestamp(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* timestamp_overhead - The shortest time between two timestamps */
+static uint64_t timestamp_overhead(void) {
+  uint64_t best = UINT64_MAX;
+
+  for (int i = 0; i < 1000; i++) {
+    uint64_t start = timestamp();
+    uint64_t ns = timestamp() - start;
+    best = (ns < best) ? ns : best;
+  }
+  return best;
+}
+
+/* hist_add - Count a latency of ns in the bucket holding it */
+static inline void hist_add(hist_t *h, uint64_t ns) {
+  int index = ns;
+
+  if (ns >= LAT_SUB) {
+    int log2 = 63 - __builtin_clzl(ns);
+    index = LAT_SUB + (log2 - LAT_SUB_BITS) * LAT_SUB +
+            (int)(ns >> (log2 - LAT_SUB_BITS)) - LAT_SUB;
+  }
+
+  h->buckets[index]++;
+  h->count++;
+  h->sum += ns;
+  h->max = (ns > h->max) ? ns : h->max;
+}
+
+/* hist_merge - Add the latencies counted in from to h */
+static void hist_merge(hist_t *h, const hist_t *from) {
+  for (int i = 0; i < LAT_BUCKETS; i++)
+    h->buckets[i] += from->buckets[i];
+  h->count += from->count;
+  h->sum += from->sum;
+  h->max = (from->max > h->max) ? from->max : h->max;
+}
+
+/* hist_percentile - The highest latency in the bucket of the q-th quantile */
+static unsigned long hist_percentile(const hist_t *h, double q) {
+  unsigned long rank = (unsigned long)(q * h->count);
+  unsigned long seen = 0;
+
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    if ((seen += h->buckets[i]) <= rank)
+      continue;
+    if (i < LAT_SUB)
+      return i;
+
+    int log2 = (i - LAT_SUB) / LAT_SUB + LAT_SUB_BITS;
+    unsigned long mantissa = (i - LAT_SUB) % LAT_SUB + LAT_SUB;
+    unsigned long upper = ((mantissa + 1) << (log2 - LAT_SUB_BITS)) - 1;
+    return (upper < h->max) ? upper : h->max;
+  }
+  return h->max;
+}
+
+/* latency_p99 - The p99 latency of all requests together */
+static unsigned long latency_p99(const latency_t *lat) {
+  hist_t all;
+
+  memset(&all, 0, sizeof(all));
+  for (int type = 0; type < 3; type++)
+    hist_merge(&all, &lat->ops[type]);
+  return hist_percentile(&all, 0.99);
+}
+
+/**********************
+ * Performance counters
+ **********************/
+
+/*
+ * counters_open - Open a counter for each event, counting in user space only.
+ *    Events the processor or the kernel doesn't provide are left out.
+ */
+static void counters_open(void) {
+  int opened = 0, error = 0;
+
+  for (int i = 0; i < N_COUNTERS; i++) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* counters may be multiplexed, the value is scaled by the time counted */
+    attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (counter_fds[i] >= 0)
+      opened++;
+    else if (error == 0)
+      error = errno;
+  }
+
+  if (opened < N_COUNTERS)
+    fprintf(stderr, "Warning: only %d of %d performance counters are "
+                    "available: %s\n",
+            opened, N_COUNTERS, strerror(error));
+}
+
+/* counters_enable - Start counting from zero */
+static void counters_enable(void) {
+  for (int i = 0; counters_mode && i < N_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+/* counters_disable - Stop counting */
+static void counters_disable(void) {
+  for (int i = 0; counters_mode && i < N_COUNTERS; i++)
+    if (counter_fds[i] >= 0)
+      ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/* counters_read - Read the values counted since counters_enable */
+static void counters_read(counters_t *counters) {
+  for (int i = 0; i < N_COUNTERS; i++) {
+    uint64_t data[3]; /* value, time enabled, time running */
+
+    counters->values[i] = -1;
+    if (counter_fds[i] < 0 ||
+        read(counter_fds[i], data, sizeof(data)) != sizeof(data))
+      continue;
+    counters->values[i] =
+      (data[2] == 0) ? 0 : (double)data[0] * data[1] / data[2];
+  }
+}
+
+/*
+ * counters_best - Run f once to warm up if it is repeated, then repeats times.
+ *    Keep the counters of the run with the fewest cycles in best.
+ */
+static void counters_best(fsecs_test_funct f, speed_t *params,
+                          counters_t *best) {
+  counters_t counters;
+
+  if (repeats > 1)
+    f(params);
+
+  for (int k = 0; k < repeats; k++) {
+    f(params);
+    counters_read(&counters);
+    if (k == 0 || counters.values[0] < best->values[0])
+      memcpy(best, &counters, sizeof(counters_t));
+  }
+}
+
+/*
+ * latency_best - Run f once to warm up if it is repeated, then repeats times.
+ *    Keep the latencies of the run with the lowest p99 in best.
+ */
+static void latency_best(fsecs_test_funct f, speed_t *params,
+                         latency_t *best) {
+  unsigned long best_p99 = ULONG_MAX;
+  latency_t *lat;
+
+  if ((lat = malloc(sizeof(latency_t))) == NULL)
+    unix_error("malloc failed in latency_best");
+  params->latency = lat;
+
+  if (repeats > 1)
+    f(params);
+
+  for (int k = 0; k < repeats; k++) {
+    f(params);
+    unsigned long p99 = latency_p99(lat);
+    if (p99 < best_p99) {
+      best_p99 = p99;
+      memcpy(best, lat, sizeof(latency_t));
+    }
+  }
+
+  free(lat);
+}
+
+/* Run the tests of the mm package on a trace that has already been read */
+static void run_tests(trace_t *trace, stats_t *mm_stats, range_t **ranges,
                       speed_t *speed_params) {
   /* initialize simulated memory system in memlib.c *
    * start each trace with a clean system */
   mem_init();
 
-  trace_t *trace;
-  trace = read_trace(mm_stats, tracefile);
-  strcpy(mm_stats->filename, trace->filename);
-  mm_stats->ops = trace->num_ops;
   if (verbose > 1)
-    printf("Checking mm_malloc for correctness, ");
-  mm_stats->valid = eval_mm_valid(trace, &ranges);
+    printf("Checking mm_malloc for correctness on %s, ", trace->filename);
+  mm_stats->valid = eval_mm_valid(trace, ranges);
 
   if (mm_stats->valid) {
     if (verbose > 1)
       printf("efficiency, ");
-    mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total);
+    mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total,
+                                  (heap_mode) ? &mm_stats->heap : NULL);
     speed_params->trace = trace;
-    speed_params->ranges = ranges;
+    speed_params->ranges = *ranges;
     if (verbose > 1)
       printf("and performance.\n");
-    mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    mm_stats->secs = fsecs_best(eval_mm_speed, speed_params);
+    if (latency_mode)
+      latency_best(eval_mm_latency, speed_params, &mm_stats->latency);
+    if (counters_mode)
+      counters_best(eval_mm_speed, speed_params, &mm_stats->counters);
+    if (threads)
+      eval_mm_threads(trace, mm_stats);
+    if (walk_phases)
+      eval_locality(trace, &mm_stats->locality, 0);
   }
 
-  free_trace(trace);
-
   /* clean up memory system */
   mem_deinit();
 }
 
+/* Run the tests of libc malloc on a trace that has already been read */
+static void run_libc_tests(trace_t *trace, stats_t *libc_stats,
+                           speed_t *speed_params) {
+  if (verbose > 1)
+    printf("Checking libc malloc on %s\n", trace->filename);
+  libc_stats->valid = eval_libc_valid(trace);
+
+  if (libc_stats->valid) {
+    speed_params->trace = trace;
+    libc_stats->secs = fsecs_best(eval_libc_speed, speed_params);
+    if (latency_mode)
+      latency_best(eval_libc_latency, speed_params, &libc_stats->latency);
+    if (counters_mode)
+      counters_best(eval_libc_speed, speed_params, &libc_stats->counters);
+    if (walk_phases)
+      eval_locality(trace, &libc_stats->locality, 1);
+  }
+}
+
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv) {
-  char *tracefile = NULL; /* trace file names */
-  range_t *ranges = NULL; /* keeps track of block extents for one trace */
-  stats_t libc_stats;     /* libc stats for trace */
-  stats_t mm_stats;       /* mm (i.e. student) stats for trace */
-  speed_t speed_params;   /* input parameters to the xx_speed routines */
-  int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  char **tracefiles = NULL; /* trace file names */
+  int num_tracefiles = 0;   /* the number of traces in that array */
+  range_t *ranges = NULL;   /* keeps track of block extents for one trace */
+  stats_t *stats;           /* stats of the allocator, one per trace */
+  speed_t speed_params;     /* input parameters to the xx_speed routines */
+  int run_libc = 0;         /* If set, run libc malloc (set by -l) */
+  int format = FMT_TEXT;    /* output format (set by -F) */
+  char *binfile = NULL;     /* binary trace to write (set by -b) */
+  char *profile = NULL;     /* heap profile to write (set by -o) */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
@@ -243,16 +644,90 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "b:d:f:F:H:k:o:p:t:T:v:w:x:hVlLPSD")) != EOF) {
     switch (c) {
-      case 'f': /* Use one specific trace file only (relative to curr dir) */
-        tracefile = strdup(optarg);
+      case 'f': /* Use a specific trace file (relative to curr dir) */
+        add_tracefile(&tracefiles, &num_tracefiles, strdup(optarg));
+        break;
+
+      case 'b': /* Convert the trace file into the binary format */
+        binfile = optarg;
+        break;
+
+      case 't': /* Use all trace files in a directory */
+        add_tracedir(&tracefiles, &num_tracefiles, optarg);
+        break;
+
+      case 'F': /* Set the output format */
+        if (strcmp(optarg, "text") == 0)
+          format = FMT_TEXT;
+        else if (strcmp(optarg, "json") == 0)
+          format = FMT_JSON;
+        else if (strcmp(optarg, "csv") == 0)
+          format = FMT_CSV;
+        else
+          app_error("unknown output format %s\n", optarg);
         break;
 
       case 'l': /* Run libc malloc */
         run_libc = 1;
         break;
 
+      case 'L': /* Time every request */
+        latency_mode = 1;
+        break;
+
+      case 'P': /* Count hardware events */
+        counters_mode = 1;
+        break;
+
+      case 'p': /* Sample the allocations */
+#ifndef PROFILE
+        app_error("mdriver has to be built with OPTS=-DPROFILE for -p\n");
+#endif
+        if ((profile_rate = atol(optarg)) < 1)
+          app_error("the sampling rate has to be positive\n");
+        break;
+
+      case 'o': /* Write the heap profile */
+        profile = optarg;
+        break;
+
+      case 'H': /* Pass hints to mm_malloc_hint */
+        if ((hint_ops = atol(optarg)) < 1)
+          app_error("the lifetime of short-lived blocks has to be positive\n");
+        break;
+
+      case 'w': /* Walk the live blocks after every phase */
+        if ((walk_phases = atoi(optarg)) < 1)
+          app_error("the number of phases has to be positive\n");
+        break;
+
+      case 'S': /* Read the heap statistics */
+#ifndef STATS
+        app_error("mdriver has to be built with OPTS=-DSTATS for -S\n");
+#endif
+        heap_mode = 1;
+        break;
+
+      case 'T': /* Replay the trace by many threads at once */
+#ifndef THREADS
+        app_error("mdriver has to be built with OPTS=-DTHREADS for -T\n");
+#endif
+        if ((threads = atoi(optarg)) < 1 || threads > MAX_THREADS)
+          app_error("the number of threads has to be in 1..%d\n", MAX_THREADS);
+        break;
+
+      case 'x': /* Pass some frees to another thread */
+        if ((remote_pct = atoi(optarg)) < 0 || remote_pct > 100)
+          app_error("the percentage of frees has to be in 0..100\n");
+        break;
+
+      case 'k': /* Repeat the timed runs */
+        if ((repeats = atoi(optarg)) < 1)
+          app_error("the number of runs has to be positive\n");
+        break;
+
       case 'V': /* Increase verbosity level */
         verbose += 1;
         break;
@@ -279,56 +754,81 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (tracefile == NULL) {
+  if (num_tracefiles == 0 || (binfile && num_tracefiles != 1) ||
+      (profile && !profile_rate)) {
     usage();
     exit(EXIT_FAILURE);
   }
 
+  if (binfile) {
+    stats = calloc(1, sizeof(stats_t));
+    write_trace(read_trace(stats, tracefiles[0]), binfile);
+    return EXIT_SUCCESS;
+  }
+
   if (debug_mode != DBG_NONE)
     init_random_data();
 
-  if (run_libc) {
-    /*
-     * Run and evaluate the libc malloc package
-     */
-    if (verbose > 1)
-      printf("\nTesting libc malloc\n");
-
-    /* Evaluate the libc malloc package using the K-best scheme */
-    trace_t *trace = read_trace(&libc_stats, tracefile);
+  if (counters_mode)
+    counters_open();
 
-    libc_stats.valid = eval_libc_valid(trace);
-    if (libc_stats.valid) {
-      speed_params.trace = trace;
-      libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
-    }
-    free_trace(trace);
+  if (profile_rate && mm_profile_start(profile_rate) < 0)
+    app_error("mm_profile_start failed\n");
 
-    /* Display the libc results in a compact table */
-    if (verbose) {
-      printf("\nResults for libc malloc:\n");
-      printresults(&libc_stats);
-    }
+  /* Read all traces up front, so the parsing is done once per trace */
+  trace_t **traces = malloc(num_tracefiles * sizeof(trace_t *));
+  if (!traces || !(stats = calloc(num_tracefiles, sizeof(stats_t))))
+    unix_error("malloc failed in main");
+  for (int i = 0; i < num_tracefiles; i++)
+    traces[i] = read_trace(&stats[i], tracefiles[i]);
 
-    return libc_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (verbose > 1)
+    printf("\nTesting %s malloc\n", run_libc ? "libc" : "mm");
+
+  /* Evaluate the malloc package on every trace using the K-best scheme */
+  int valid = 1;
+  for (int i = 0; i < num_tracefiles; i++) {
+    if (run_libc)
+      run_libc_tests(traces[i], &stats[i], &speed_params);
+    else
+      run_tests(traces[i], &stats[i], &ranges, &speed_params);
+    valid &= stats[i].valid;
   }
 
-  /*
-   * Run and evaluate the student's mm package
-   */
-  if (verbose > 1)
-    printf("\nTesting mm malloc\n");
+  /* Display the results in a compact table or in a machine readable form */
+  if (format == FMT_JSON) {
+    printjson(stats, num_tracefiles);
+  } else if (format == FMT_CSV) {
+    printcsv(stats, num_tracefiles);
+  } else if (verbose) {
+    printf("\nResults for %s malloc:\n", run_libc ? "libc" : "mm");
+    printresults(stats, num_tracefiles);
+    for (int i = 0; i < num_tracefiles; i++) {
+      printlatency(&stats[i]);
+      printcounters(&stats[i]);
+      printscaling(&stats[i]);
+      printheap(&stats[i]);
+      printlocality(&stats[i]);
+    }
+  }
 
-  /* Allocate the mm stats array, with one stats_t struct per tracefile */
-  run_tests(tracefile, &mm_stats, ranges, &speed_params);
+  /* The sites of all runs, the live samples of the last one */
+  if (profile) {
+    FILE *fp = fopen(profile, "w");
+    if (fp == NULL || mm_profile_dump(fileno(fp)) < 0)
+      unix_error("could not write the heap profile to %s", profile);
+    fclose(fp);
+  }
 
-  /* Display the mm results */
-  if (verbose) {
-    printf("\nResults for mm malloc:\n");
-    printresults(&mm_stats);
+  for (int i = 0; i < num_tracefiles; i++) {
+    free_trace(traces[i]);
+    free(tracefiles[i]);
   }
+  free(traces);
+  free(tracefiles);
+  free(stats);
 
-  return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  return valid ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /*****************************************************************
@@ -356,9 +856,10 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-      (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+  /* The payload must lie within the extent of the heap or of a mapped area */
+  if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+       (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+      !mem_mapped(lo, hi)) {
     malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)", lo,
                  hi, mem_heap_lo(), mem_heap_hi());
     return 0;
@@ -484,6 +985,107 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  * The following routines manipulate tracefiles
  *********************************************/
 
+/*
+ * add_tracefile - append a trace file name to the list of traces to run
+ */
+static void add_tracefile(char ***files, int *n, char *filename) {
+  if (!(*files = realloc(*files, (*n + 1) * sizeof(char *))))
+    unix_error("realloc failed in add_tracefile");
+  (*files)[(*n)++] = filename;
+}
+
+/* scandir filter that picks the text and binary trace files */
+static int is_tracefile(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+  return len > 4 && (strcmp(entry->d_name + len - 4, ".rep") == 0 ||
+                     strcmp(entry->d_name + len - 4, ".bin") == 0);
+}
+
+/*
+ * add_tracedir - append all .rep and .bin files in a directory, sorted by name
+ */
+static void add_tracedir(char ***files, int *n, const char *dirname) {
+  struct dirent **entries;
+  int count;
+
+  if ((count = scandir(dirname, &entries, is_tracefile, alphasort)) < 0)
+    unix_error("Could not read directory %s", dirname);
+
+  for (int i = 0; i < count; i++) {
+    char *path = malloc(strlen(dirname) + strlen(entries[i]->d_name) + 2);
+    if (!path)
+      unix_error("malloc failed in add_tracedir");
+    sprintf(path, "%s/%s", dirname, entries[i]->d_name);
+    add_tracefile(files, n, path);
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+/*
+ * map_trace - map the records of a binary trace, they are read from the file
+ *     by the kernel in chunks as the replay goes through them
+ */
+static void map_trace(trace_t *trace, FILE *tracefile) {
+  struct stat st;
+  size_t length =
+    sizeof(trace_header_t) + (size_t)trace->num_ops * sizeof(traceop_t);
+
+  if (fstat(fileno(tracefile), &st) < 0)
+    unix_error("Could not stat %s in read_trace", trace->filename);
+  if ((size_t)st.st_size != length)
+    app_error("%s: size doesn't match the number of requests\n",
+              trace->filename);
+
+  void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(tracefile), 0);
+  if (addr == MAP_FAILED)
+    unix_error("Could not map %s in read_trace", trace->filename);
+  madvise(addr, length, MADV_SEQUENTIAL);
+
+  trace->ops = (traceop_t *)((char *)addr + sizeof(trace_header_t));
+  trace->mapped = length;
+}
+
+/*
+ * check_trace - check that the records of a binary trace make sense, as
+ *     nothing else does it before they are replayed
+ */
+static void check_trace(trace_t *trace) {
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+    if (op->type > REALLOC)
+      app_error("Bogus request type (%u) in tracefile %s\n", op->type,
+                trace->filename);
+    if (op->index < -1 || op->index >= trace->num_ids ||
+        (op->index < 0 && op->type != FREE))
+      app_error("Bogus block index (%d) in tracefile %s\n", op->index,
+                trace->filename);
+    if (op->size > INT_MAX)
+      app_error("Bogus request size (%llu) in tracefile %s\n",
+                (unsigned long long)op->size, trace->filename);
+  }
+}
+
+/*
+ * write_trace - write a trace in the binary format
+ */
+static void write_trace(trace_t *trace, const char *filename) {
+  FILE *file;
+  trace_header_t header = {.weight = trace->weight,
+                           .num_ids = trace->num_ids,
+                           .num_ops = trace->num_ops,
+                           .ignore_ranges = trace->ignore_ranges};
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+  if (!(file = fopen(filename, "w")))
+    unix_error("Could not create %s in write_trace", filename);
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, file) !=
+        (size_t)trace->num_ops ||
+      fclose(file) != 0)
+    unix_error("Could not write %s in write_trace", filename);
+}
+
 /*
  * read_trace - read a trace file and store it in memory
  */
@@ -503,19 +1105,42 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   if (!(tracefile = fopen(trace->filename, "r")))
     unix_error("Could not open %s in read_trace", trace->filename);
 
-  int ignore = 0;
-  ignore += fscanf(tracefile, "%d", &trace->weight);
-  ignore += fscanf(tracefile, "%d", &trace->num_ids);
-  ignore += fscanf(tracefile, "%d", &trace->num_ops);
-  ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+  /* binary traces start with the magic, text ones with a number, only the
+     first character is peeked as the file can be a pipe */
+  trace_header_t header;
+  int c = getc(tracefile);
+  int binary = c == TRACE_MAGIC[0];
+  ungetc(c, tracefile);
+
+  if (binary) {
+    if (fread(&header, sizeof(header), 1, tracefile) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+      app_error("%s: bad header of a binary trace", trace->filename);
+    if (header.num_ids > INT_MAX || header.num_ops > INT_MAX)
+      app_error("%s: too many requests", trace->filename);
+    trace->weight = header.weight;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->ignore_ranges = header.ignore_ranges;
+  } else if (fscanf(tracefile, "%d %d %d %d", &trace->weight, &trace->num_ids,
+                    &trace->num_ops, &trace->ignore_ranges) != 4) {
+    app_error("%s: bad header", trace->filename);
+  }
 
   if (trace->weight < 0 || trace->weight > 3)
     app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
   if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
     app_error("%s: ignore-ranges can only be zero or one", trace->filename);
-
-  /* We'll store each request line in the trace in this array */
-  if (!(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
+  if (trace->num_ids < 0 || trace->num_ops < 0)
+    app_error("%s: negative number of blocks or requests", trace->filename);
+
+  /* We'll store each request line in the trace in this array, the records
+   * of a binary trace are mapped instead */
+  trace->mapped = 0;
+  if (binary)
+    map_trace(trace, tracefile);
+  else if (!(trace->ops = (traceop_t *)malloc(trace->num_ops *
+                                               sizeof(traceop_t))))
     unix_error("malloc 2 failed in read_trace");
 
   /* We'll keep an array of pointers to the allocated blocks here... */
@@ -531,6 +1156,12 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
           calloc(trace->num_ids, sizeof(*trace->block_rand_base))))
     unix_error("malloc 5 failed in read_trace");
 
+  if (binary) {
+    fclose(tracefile);
+    check_trace(trace);
+    goto done;
+  }
+
   /* read every request line in the trace file */
   int index = 0;
   int op_index = 0;
@@ -538,43 +1169,54 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   char type[MAXLINE];
   int size;
 
-  while (fscanf(tracefile, "%s", type) != EOF) {
+  while (op_index < trace->num_ops && fscanf(tracefile, "%s", type) != EOF) {
+    int ok;
     switch (type[0]) {
       case 'a':
-        ignore += fscanf(tracefile, "%u %u", &index, &size);
+        ok = fscanf(tracefile, "%u %u", &index, &size) == 2;
         trace->ops[op_index].type = ALLOC;
-        trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
         break;
 
       case 'r':
-        ignore += fscanf(tracefile, "%u %u", &index, &size);
+        ok = fscanf(tracefile, "%u %u", &index, &size) == 2;
         trace->ops[op_index].type = REALLOC;
-        trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
         break;
 
       case 'f':
-        ignore += fscanf(tracefile, "%ud", &index);
+        ok = fscanf(tracefile, "%ud", &index) == 1;
         trace->ops[op_index].type = FREE;
-        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = 0;
         break;
 
       default:
         app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                   trace->filename);
     }
+    if (!ok)
+      app_error("Bad request %d in tracefile %s\n", op_index, trace->filename);
+    if (size < 0)
+      app_error("Bogus request size (%u) in tracefile %s\n", size,
+                trace->filename);
+    if (index < -1 || index >= trace->num_ids ||
+        (index < 0 && trace->ops[op_index].type != FREE))
+      app_error("Bogus block index (%d) in tracefile %s\n", index,
+                trace->filename);
+    trace->ops[op_index].index = index;
+    max_index = (index > max_index) ? index : max_index;
     op_index++;
-    if (op_index == trace->num_ops)
-      break;
   }
 
   fclose(tracefile);
   assert(max_index == trace->num_ids - 1);
   assert(trace->num_ops == op_index);
 
+done:
+  trace->hints = NULL;
+  if (hint_ops)
+    hint_trace(trace);
+
   /* fill in the stats */
   strcpy(stats->filename, trace->filename);
   stats->weight = trace->weight;
@@ -583,6 +1225,46 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   return trace;
 }
 
+/*
+ * hint_trace - Finds a hint for every allocation of the trace. Blocks freed
+ *     within hint_ops requests are short-lived, the others are put next to
+ *     the long-lived block allocated last, if it's still live, so the blocks
+ *     of a structure built one after another stay together.
+ */
+static void hint_trace(trace_t *trace) {
+  int *death, last = -1;
+
+  if (!(trace->hints = malloc(trace->num_ops * sizeof(int))) ||
+      !(death = malloc(trace->num_ids * sizeof(int))))
+    unix_error("malloc failed in hint_trace");
+
+  /* the request that frees each block, going backwards */
+  for (int index = 0; index < trace->num_ids; index++)
+    death[index] = INT_MAX;
+  for (int i = trace->num_ops - 1; i >= 0; i--) {
+    int index = trace->ops[i].index;
+    if (trace->ops[i].type == FREE && index >= 0) {
+      death[index] = i;
+    } else if (trace->ops[i].type == ALLOC) {
+      trace->hints[i] = ((long)death[index] - i < hint_ops) ? HINT_SHORT : 0;
+      death[index] = INT_MAX;
+    }
+  }
+
+  /* ... and the long-lived block before each one, going forwards */
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    if (trace->ops[i].type == FREE && index >= 0 && index == last) {
+      last = -1;
+    } else if (trace->ops[i].type == ALLOC && trace->hints[i] != HINT_SHORT) {
+      trace->hints[i] = (last >= 0) ? last : HINT_LONG;
+      last = index;
+    }
+  }
+
+  free(death);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -597,10 +1279,14 @@ static void reinit_trace(trace_t *trace) {
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
-  free(trace->ops); /* free the three arrays... */
+  if (trace->mapped) /* free the three arrays... */
+    munmap((char *)trace->ops - sizeof(trace_header_t), trace->mapped);
+  else
+    free(trace->ops);
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
+  free(trace->hints);
   free(trace); /* and the trace record itself... */
 }
 
@@ -609,6 +1295,22 @@ static void free_trace(trace_t *trace) {
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * hint_malloc - Allocates the block of request i with mm_malloc_hint if the
+ *     trace has hints, with mm_malloc otherwise
+ */
+static inline void *hint_malloc(trace_t *trace, int i, size_t size) {
+  if (trace->hints == NULL)
+    return mm_malloc(size);
+
+  int hint = trace->hints[i];
+  if (hint == HINT_SHORT)
+    return mm_malloc_hint(size, MM_HINT_SHORT);
+  if (hint == HINT_LONG)
+    return mm_malloc_hint(size, MM_HINT_LONG);
+  return mm_malloc_hint(size, trace->blocks[hint]);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -647,7 +1349,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
         /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
+        if ((p = hint_malloc(trace, i, size)) == NULL) {
           malloc_error(trace, i, "mm_malloc failed.");
           return 0;
         }
@@ -720,6 +1422,20 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     }
   }
 
+  /* Sizes that can't be allocated, products near and past SIZE_MAX */
+  static const size_t callocs[][2] = {{1, SIZE_MAX},
+                                      {1, SIZE_MAX - 100},
+                                      {SIZE_MAX / 16, 16},
+                                      {SIZE_MAX / 2 + 1, 2}};
+  for (size_t i = 0; i < sizeof(callocs) / sizeof(callocs[0]); i++) {
+    void *p = mm_calloc(callocs[i][0], callocs[i][1]);
+    if (p != NULL) {
+      malloc_error(trace, trace->num_ops, "mm_calloc(%zu, %zu) returned %p.",
+                   callocs[i][0], callocs[i][1], p);
+      return 0;
+    }
+  }
+
   /* As far as we know, this is a valid malloc package */
   return 1;
 }
@@ -730,13 +1446,16 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. Note that the allocator may decrement the brk
+ *   pointer and map memory outside of the heap, so the heap size is the high
+ *   water mark of brk and mapped memory together. If peak isn't NULL the
+ *   heap statistics are read into it whenever the live bytes reach a new
+ *   high water mark.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
+static double eval_mm_util(trace_t *trace, int *used_p, int *total_p,
+                           struct mm_stats *peak) {
   int max_total_size = 0;
   int total_size = 0;
 
@@ -756,7 +1475,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = hint_malloc(trace, i, size)) == NULL)
           app_error("trace: mm_malloc failed in eval_mm_util");
 
         /* Remember region and size */
@@ -802,14 +1521,17 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
     }
 
     /* update the high-water mark */
-    max_total_size =
-      (total_size > max_total_size) ? total_size : max_total_size;
+    if (total_size > max_total_size) {
+      max_total_size = total_size;
+      if (peak)
+        mm_stats(peak);
+    }
   }
 
   *used_p = max_total_size;
-  *total_p = mem_heapsize();
+  *total_p = mem_heappeak();
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  return ((double)max_total_size / (double)mem_heappeak());
 }
 
 /*
@@ -826,6 +1548,7 @@ static void eval_mm_speed(void *ptr) {
     app_error("mm_init failed in eval_mm_speed");
 
   /* Interpret each trace request */
+  counters_enable();
   for (int i = 0; i < trace->num_ops; i++) {
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
@@ -834,7 +1557,7 @@ static void eval_mm_speed(void *ptr) {
       case ALLOC: /* mm_malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = hint_malloc(trace, i, size)) == NULL)
           app_error("mm_malloc error in eval_mm_speed");
         trace->blocks[index] = p;
         break;
@@ -862,6 +1585,384 @@ static void eval_mm_speed(void *ptr) {
         app_error("Nonexistent request type in eval_mm_speed");
     }
   }
+  counters_disable();
+}
+
+/*
+ * eval_mm_latency - Run the trace like eval_mm_speed, timing every request
+ *    of the mm malloc package on its own.
+ */
+static void eval_mm_latency(void *ptr) {
+  trace_t *trace = ((speed_t *)ptr)->trace;
+  latency_t *lat = ((speed_t *)ptr)->latency;
+
+  memset(lat, 0, sizeof(latency_t));
+  reinit_trace(trace);
+
+  /* Reset the heap and initialize the mm package */
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_latency");
+
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    int size = trace->ops[i].size;
+    char *p = (index < 0) ? NULL : trace->blocks[index];
+    uint64_t start = timestamp();
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        p = hint_malloc(trace, i, size);
+        break;
+
+      case REALLOC: /* mm_realloc */
+        p = mm_realloc(p, size);
+        break;
+
+      case FREE: /* mm_free */
+        mm_free(p);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_latency");
+    }
+
+    hist_add(&lat->ops[trace->ops[i].type], timestamp() - start);
+
+    if (trace->ops[i].type != FREE) {
+      if (p == NULL && size != 0)
+        app_error("mm_malloc error in eval_mm_latency");
+      trace->blocks[index] = p;
+    }
+  }
+}
+
+/* compare_pages - Order page numbers for qsort */
+static int compare_pages(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * walk_blocks - Links the live blocks in the order of their ids through their
+ *     first words and follows the links, reading a byte of every line of each
+ *     payload, so every block waits for the load of the one before it like in
+ *     a linked structure. Blocks too small for a link are left out.
+ */
+static void walk_blocks(trace_t *trace, locality_t *loc, size_t *sizes,
+                        uintptr_t *pages) {
+  char *first = NULL, **link = &first;
+  size_t blocks = 0, bytes = 0, num_pages = 0;
+
+  for (int index = 0; index < trace->num_ids; index++) {
+    char *p = trace->blocks[index];
+    size_t size = trace->block_sizes[index];
+    if (p == NULL || size < sizeof(char *))
+      continue;
+
+    *link = p;
+    link = (char **)p;
+    sizes[blocks++] = size;
+    bytes += size;
+    for (uintptr_t page = (uintptr_t)p / WALK_PAGE;
+         page <= ((uintptr_t)p + size - 1) / WALK_PAGE; page++)
+      pages[num_pages++] = page;
+  }
+  *link = NULL;
+
+  /* the best of the timed walks */
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < repeats; run++) {
+    uint64_t start = timestamp();
+    char sum = 0;
+    size_t n = 0;
+    for (char *p = first; p != NULL; p = *(char **)p, n++)
+      for (size_t offset = WALK_LINE; offset < sizes[n]; offset += WALK_LINE)
+        sum += p[offset];
+    uint64_t ns = timestamp() - start;
+    best = (ns < best) ? ns : best;
+    walk_sink = sum;
+  }
+
+  /* distinct pages the payloads are in */
+  qsort(pages, num_pages, sizeof(*pages), compare_pages);
+  size_t distinct = 0;
+  for (size_t i = 0; i < num_pages; i++)
+    distinct += (i == 0 || pages[i] != pages[i - 1]);
+
+  loc->walks++;
+  loc->blocks += blocks;
+  loc->ns += best;
+  loc->pages += distinct;
+  loc->min_pages += (bytes + WALK_PAGE - 1) / WALK_PAGE;
+}
+
+/*
+ * eval_locality - Replays the trace split into walk_phases phases and walks
+ *     the live blocks after each of them.
+ */
+static void eval_locality(trace_t *trace, locality_t *loc, int libc) {
+  size_t max_pages = 0;
+  size_t *sizes;
+  uintptr_t *pages = NULL;
+
+  memset(loc, 0, sizeof(*loc));
+  reinit_trace(trace);
+  if (!(sizes = malloc(trace->num_ids * sizeof(*sizes))))
+    unix_error("malloc failed in eval_locality");
+
+  /* Reset the heap and initialize the mm package */
+  if (!libc) {
+    mem_reset_brk();
+    if (mm_init() < 0)
+      app_error("mm_init failed in eval_locality");
+  }
+
+  int phase = (trace->num_ops + walk_phases - 1) / walk_phases;
+  size_t live_pages = 0;
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p = (index < 0) ? NULL : trace->blocks[index];
+
+    /* every block takes at most this many pages */
+    if (p != NULL)
+      live_pages -= trace->block_sizes[index] / WALK_PAGE + 2;
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        p = (libc) ? malloc(size) : hint_malloc(trace, i, size);
+        break;
+
+      case REALLOC: /* mm_realloc */
+        p = (libc) ? realloc(p, size) : mm_realloc(p, size);
+        break;
+
+      case FREE: /* mm_free */
+        if (libc)
+          free(p);
+        else
+          mm_free(p);
+        p = NULL;
+        size = 0;
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_locality");
+    }
+
+    if (p == NULL && size != 0)
+      app_error("malloc error in eval_locality");
+    if (index >= 0) {
+      trace->blocks[index] = p;
+      trace->block_sizes[index] = size;
+      if (p != NULL)
+        live_pages += size / WALK_PAGE + 2;
+    }
+
+    if ((i + 1) % phase == 0 || i == trace->num_ops - 1) {
+      if (live_pages > max_pages) {
+        max_pages = 2 * live_pages;
+        if (!(pages = realloc(pages, max_pages * sizeof(*pages))))
+          unix_error("realloc failed in eval_locality");
+      }
+      walk_blocks(trace, loc, sizes, pages);
+    }
+  }
+
+  /* libc keeps its heap, so the blocks still live are freed */
+  for (int index = 0; libc && index < trace->num_ids; index++)
+    free(trace->blocks[index]);
+
+  free(sizes);
+  free(pages);
+}
+
+#ifdef THREADS
+/*
+ * mailbox_push - pass the block to the next thread, fails if the ring is full
+ */
+static int mailbox_push(mailbox_t *mb, void *p) {
+  unsigned long tail = mb->tail;
+  if (tail - __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE) == MAILBOX_SIZE)
+    return 0;
+  mb->slots[tail % MAILBOX_SIZE] = p;
+  __atomic_store_n(&mb->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * mailbox_drain - free all blocks passed by the previous thread
+ */
+static void mailbox_drain(mailbox_t *mb) {
+  unsigned long head = mb->head;
+  unsigned long tail = __atomic_load_n(&mb->tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return;
+  for (; head != tail; head++)
+    mm_free(mb->slots[head % MAILBOX_SIZE]);
+  __atomic_store_n(&mb->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * replay_thread - replay the trace in one of the threads, remote_pct percent
+ *     of the frees are passed to the next thread
+ */
+static void *replay_thread(void *arg) {
+  replayer_t *r = arg;
+  trace_t *trace = &r->trace;
+
+  pthread_barrier_wait(r->start);
+  r->begin = timestamp();
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p;
+
+    if (i % 16 == 0)
+      mailbox_drain(r->inbox);
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(size)) == NULL) {
+          r->failed = 1;
+          goto done;
+        }
+        trace->blocks[index] = p;
+        break;
+
+      case REALLOC: /* mm_realloc */
+        if ((p = mm_realloc(trace->blocks[index], size)) == NULL &&
+            size != 0) {
+          r->failed = 1;
+          goto done;
+        }
+        trace->blocks[index] = p;
+        break;
+
+      case FREE: /* mm_free */
+        p = (index < 0) ? NULL : trace->blocks[index];
+        r->seed = r->seed * 1103515245 + 12345;
+        if (p == NULL || (int)((r->seed >> 16) % 100) >= remote_pct ||
+            !mailbox_push(r->outbox, p))
+          mm_free(p);
+        break;
+    }
+  }
+
+done:
+  /* the last blocks are freed when no thread can pass any more */
+  pthread_barrier_wait(r->done);
+  mailbox_drain(r->inbox);
+  r->end = timestamp();
+  return NULL;
+}
+
+/*
+ * replay_threads - replay the trace by n threads at once on a fresh heap,
+ *     returns the time it took or -1 if the allocator ran out of memory
+ */
+static double replay_threads(replayer_t *r, mailbox_t *mb, int n,
+                             scaling_t *step) {
+  pthread_t tids[MAX_THREADS];
+  pthread_barrier_t start, done;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in replay_threads");
+
+  pthread_barrier_init(&start, NULL, n + 1);
+  pthread_barrier_init(&done, NULL, n);
+  for (int i = 0; i < n; i++) {
+    reinit_trace(&r[i].trace);
+    mb[i].head = mb[i].tail = 0;
+    r[i].inbox = &mb[i];
+    r[i].outbox = &mb[(i + 1) % n];
+    r[i].start = &start;
+    r[i].done = &done;
+    r[i].seed = i + 1;
+    r[i].failed = 0;
+    if ((errno = pthread_create(&tids[i], NULL, replay_thread, &r[i])))
+      unix_error("pthread_create failed in replay_threads");
+  }
+
+  /* the time from the first thread starting to the last one finishing */
+  pthread_barrier_wait(&start);
+  uint64_t begin = UINT64_MAX, end = 0;
+  int failed = 0;
+  for (int i = 0; i < n; i++) {
+    pthread_join(tids[i], NULL);
+    begin = (r[i].begin < begin) ? r[i].begin : begin;
+    end = (r[i].end > end) ? r[i].end : end;
+    failed |= r[i].failed;
+  }
+  double secs = (end - begin) * 1e-9;
+
+  pthread_barrier_destroy(&start);
+  pthread_barrier_destroy(&done);
+
+  step->locks = step->contended = step->remote = 0;
+  struct mm_arena_stats st;
+  for (int i = 0; mm_arena_stats(i, &st) == 0; i++) {
+    step->locks += st.locks;
+    step->contended += st.contended;
+    step->remote += st.remote;
+  }
+
+  return failed ? -1 : secs;
+}
+#endif
+
+/*
+ * eval_mm_threads - replay the trace by 1, 2, 4, ... threads at once, each
+ *     with its own copy of the blocks arrays, up to the number set by -T.
+ *     The best of repeats runs is kept for every number of threads.
+ */
+static void eval_mm_threads(trace_t *trace, stats_t *stats) {
+#ifdef THREADS
+  replayer_t *r = calloc(threads, sizeof(replayer_t));
+  mailbox_t *mb = aligned_alloc(64, threads * sizeof(mailbox_t));
+  if (r == NULL || mb == NULL)
+    unix_error("malloc failed in eval_mm_threads");
+
+  for (int i = 0; i < threads; i++) {
+    r[i].trace = *trace;
+    r[i].trace.blocks = calloc(trace->num_ids, sizeof(char *));
+    r[i].trace.block_sizes = calloc(trace->num_ids, sizeof(size_t));
+    if (!r[i].trace.blocks || !r[i].trace.block_sizes)
+      unix_error("malloc failed in eval_mm_threads");
+  }
+
+  stats->num_steps = 0;
+  for (int n = 1;; n = (2 * n < threads) ? 2 * n : threads) {
+    scaling_t *step = &stats->scaling[stats->num_steps++];
+    scaling_t run;
+
+    step->threads = n;
+    step->secs = DBL_MAX;
+    for (int k = (repeats > 1) ? -1 : 0; k < repeats; k++) {
+      double secs = replay_threads(r, mb, n, &run);
+      if (secs < 0) {
+        step->secs = -1;
+        break;
+      }
+      if (k >= 0 && secs < step->secs) {
+        *step = run;
+        step->threads = n;
+        step->secs = secs;
+      }
+    }
+    if (n == threads)
+      break;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    free(r[i].trace.blocks);
+    free(r[i].trace.block_sizes);
+  }
+  free(mb);
+  free(r);
+#endif
 }
 
 /*
@@ -922,6 +2023,7 @@ static void eval_libc_speed(void *ptr) {
 
   reinit_trace(trace);
 
+  counters_enable();
   for (int i = 0; i < trace->num_ops; i++) {
     char *p, *newp, *oldp, *block;
     int index, size, newsize;
@@ -956,6 +2058,48 @@ static void eval_libc_speed(void *ptr) {
         break;
     }
   }
+  counters_disable();
+}
+
+/*
+ * eval_libc_latency - Run the trace like eval_libc_speed, timing every
+ *    request of the libc malloc package on its own.
+ */
+static void eval_libc_latency(void *ptr) {
+  trace_t *trace = ((speed_t *)ptr)->trace;
+  latency_t *lat = ((speed_t *)ptr)->latency;
+
+  memset(lat, 0, sizeof(latency_t));
+  reinit_trace(trace);
+
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    int size = trace->ops[i].size;
+    char *p = (index < 0) ? NULL : trace->blocks[index];
+    uint64_t start = timestamp();
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* malloc */
+        p = malloc(size);
+        break;
+
+      case REALLOC: /* realloc */
+        p = realloc(p, size);
+        break;
+
+      case FREE: /* free */
+        free(p);
+        break;
+    }
+
+    hist_add(&lat->ops[trace->ops[i].type], timestamp() - start);
+
+    if (trace->ops[i].type != FREE) {
+      if (p == NULL && size != 0)
+        unix_error("malloc failed in eval_libc_latency");
+      trace->blocks[index] = p;
+    }
+  }
 }
 
 /*************************************
@@ -963,12 +2107,9 @@ static void eval_libc_speed(void *ptr) {
  ************************************/
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * printresult - prints the row of the summary for one trace
  */
-static void printresults(stats_t *stats) {
-  /* Print the individual results for each trace */
-  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
-         "ops", "secs", "Kops", "trace");
+static void printresult(stats_t *stats) {
   if (!stats->valid) {
     printf("%2s%4s %6s%8s%10s%7s %s\n", stats->weight != 0 ? "*" : "", "no",
            "-", "-", "-", "-", stats->filename);
@@ -1014,6 +2155,337 @@ static void printresults(stats_t *stats) {
   printf(" %s\n", stats->filename);
 }
 
+/*
+ * printresults - prints a performance summary for some malloc package
+ */
+static void printresults(stats_t *stats, int n) {
+  /* Print the individual results for each trace */
+  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
+         "ops", "secs", "Kops", "trace");
+  for (int i = 0; i < n; i++)
+    printresult(&stats[i]);
+  if (n == 1)
+    return;
+
+  /* The total utilization is the sum of used bytes over the sum of heap
+   * sizes, the throughput is taken over the valid traces */
+  double used = 0, total = 0, ops = 0, secs = 0;
+  int valid = 0;
+  for (int i = 0; i < n; i++) {
+    if (!stats[i].valid)
+      continue;
+    used += stats[i].used;
+    total += stats[i].total;
+    ops += stats[i].ops;
+    secs += stats[i].secs;
+    valid++;
+  }
+  printf("%6s %5.1f%% %8.0f %8.0f%8.0f%10.6f%7.0f %d/%d valid\n", "total",
+         total > 0 ? used / total * 100.0 : 0.0, used, total, ops, secs,
+         secs > 0 ? (ops / 1e3) / secs : 0.0, valid, n);
+}
+
+/*
+ * printlatency - prints the latency percentiles of each type of request
+ */
+static void printlatency(stats_t *stats) {
+  if (!latency_mode || !stats->valid)
+    return;
+
+  printf("\nLatency in ns of %s (", stats->filename);
+  if (repeats > 1)
+    printf("best of %d runs by p99, ", repeats);
+  printf("timer overhead of %lu ns included):\n",
+         (unsigned long)timestamp_overhead());
+  printf("  %-8s%10s%10s%10s%10s%10s%10s\n", "request", "count", "mean", "p50",
+         "p99", "p99.9", "max");
+
+  for (int type = 0; type < 3; type++) {
+    const hist_t *h = &stats->latency.ops[type];
+    if (h->count == 0)
+      continue;
+    printf("  %-8s%10lu%10.1f%10lu%10lu%10lu%10lu\n", request_names[type],
+           h->count, h->sum / h->count, hist_percentile(h, 0.5),
+           hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+  }
+}
+
+/*
+ * printcounters - prints the performance counters per request
+ */
+static void printcounters(stats_t *stats) {
+  if (!counters_mode || !stats->valid)
+    return;
+
+  printf("\nCounters per request of %s", stats->filename);
+  if (repeats > 1)
+    printf(" (best of %d runs by cycles)", repeats);
+  printf(":\n ");
+  for (int i = 0; i < N_COUNTERS; i++)
+    printf(" %12s", events[i].name);
+  printf("\n ");
+
+  for (int i = 0; i < N_COUNTERS; i++) {
+    if (stats->counters.values[i] < 0)
+      printf(" %12s", "--");
+    else
+      printf(" %12.3f", stats->counters.values[i] / stats->ops);
+  }
+  printf("\n");
+}
+
+/*
+ * printscaling - prints the throughput of the threads mode by thread count
+ */
+static void printscaling(stats_t *stats) {
+  if (!threads || !stats->valid)
+    return;
+
+  printf("\nScaling of %s (%d%% of frees by another thread", stats->filename,
+         remote_pct);
+  if (repeats > 1)
+    printf(", best of %d runs", repeats);
+  printf("):\n");
+  printf("  %7s%10s%10s%9s%12s%11s%12s\n", "threads", "secs", "Kops",
+         "speedup", "locks", "contended", "remote");
+
+  double base = 0;
+  for (int i = 0; i < stats->num_steps; i++) {
+    scaling_t *step = &stats->scaling[i];
+    if (step->secs < 0) {
+      printf("  %7d  out of memory\n", step->threads);
+      continue;
+    }
+    double kops = step->threads * stats->ops / 1e3 / step->secs;
+    if (i == 0)
+      base = kops;
+    printf("  %7d%10.6f%10.0f%9.2f%12zu%10.2f%%%12zu\n", step->threads,
+           step->secs, kops, (base > 0) ? kops / base : 0.0, step->locks,
+           (step->locks) ? 100.0 * step->contended / step->locks : 0.0,
+           step->remote);
+  }
+}
+
+/*
+ * printheap - prints the heap statistics at the peak of live bytes
+ */
+static void printheap(stats_t *stats) {
+  const struct mm_stats *st = &stats->heap;
+
+  if (!heap_mode || !stats->valid)
+    return;
+
+  printf("\nHeap of %s at the peak of live bytes:\n", stats->filename);
+  printf("  heap %zu bytes, huge %zu blocks (%zu bytes), largest free %zu "
+         "bytes\n",
+         st->heap_bytes, st->huge_blocks, st->huge_bytes, st->largest_free);
+  printf("  fragmentation %.2f%% internal, %.2f%% external\n",
+         100 * st->internal, 100 * st->external);
+  printf("  %zu splits, %zu coalesces, %zu extends (%zu bytes), %zu trims\n",
+         st->splits, st->coalesces, st->extends, st->extend_bytes, st->trims);
+
+  printf("  %-8s", "free <=");
+  for (int i = 0; i < MM_STATS_BUCKETS - 1; i++)
+    printf("%7zu", st->class_bytes[i]);
+  printf("%7s\n  %-8s", "more", "blocks");
+  for (int i = 0; i < MM_STATS_BUCKETS; i++)
+    printf("%7zu", st->free_blocks[i]);
+  printf("\n  %-8s", "KiB");
+  for (int i = 0; i < MM_STATS_BUCKETS; i++)
+    printf("%7.1f", st->free_bytes[i] / 1024.0);
+
+  /* the histogram ends at the last class that was hit */
+  int last = MM_STATS_PROBES - 1;
+  while (last > 0 && st->probes[last] == 0)
+    last--;
+  printf("\n  %-8s", "probes>=");
+  for (int i = 0; i <= last; i++)
+    printf("%7d", (i) ? 1 << (i - 1) : 0);
+  printf("\n  %-8s", "fits");
+  for (int i = 0; i <= last; i++)
+    printf("%7zu", st->probes[i]);
+  printf("\n");
+}
+
+/*
+ * printlocality - prints the walks of the live blocks of the locality mode
+ */
+static void printlocality(stats_t *stats) {
+  const locality_t *loc = &stats->locality;
+
+  if (!walk_phases || !stats->valid)
+    return;
+
+  printf("\nLocality of %s (%d walks", stats->filename, loc->walks);
+  if (hint_ops)
+    printf(", short-lived below %ld requests", hint_ops);
+  if (repeats > 1)
+    printf(", best of %d runs", repeats);
+  printf("):\n");
+  printf("  %.0f blocks walked, %.1f ns per block, %.0f pages for %.0f pages "
+         "of payloads (%.2fx)\n",
+         loc->blocks, (loc->blocks) ? loc->ns / loc->blocks : 0.0, loc->pages,
+         loc->min_pages, (loc->min_pages) ? loc->pages / loc->min_pages : 0.0);
+}
+
+/*
+ * printjsonstr - prints a string as a JSON string literal
+ */
+static void printjsonstr(const char *str) {
+  putchar('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      putchar('\\');
+    if ((unsigned char)*str < ' ')
+      printf("\\u%04x", *str);
+    else
+      putchar(*str);
+  }
+  putchar('"');
+}
+
+/*
+ * printjson - prints the results of all traces as an array of JSON objects,
+ *     the latency and counters objects are there only in their modes
+ */
+static void printjson(stats_t *stats, int n) {
+  printf("[\n");
+  for (int i = 0; i < n; i++) {
+    stats_t *s = &stats[i];
+
+    printf("  {\"trace\": ");
+    printjsonstr(s->filename);
+    printf(", \"valid\": %s", s->valid ? "true" : "false");
+    if (s->valid) {
+      printf(", \"ops\": %.0f, \"secs\": %.9f, \"util\": %.6f", s->ops,
+             s->secs, s->util);
+      printf(", \"used\": %d, \"total\": %d", s->used, s->total);
+    }
+
+    if (s->valid && latency_mode) {
+      printf(",\n   \"latency\": {");
+      for (int type = 0; type < 3; type++) {
+        const hist_t *h = &s->latency.ops[type];
+        printf("%s\"%s\": {\"count\": %lu", type ? ", " : "",
+               request_names[type], h->count);
+        if (h->count > 0)
+          printf(", \"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, "
+                 "\"p99.9\": %lu, \"max\": %lu",
+                 h->sum / h->count, hist_percentile(h, 0.5),
+                 hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+        printf("}");
+      }
+      printf("}");
+    }
+
+    if (s->valid && counters_mode) {
+      printf(",\n   \"counters\": {");
+      for (int j = 0; j < N_COUNTERS; j++) {
+        printf("%s\"%s\": ", j ? ", " : "", events[j].name);
+        if (s->counters.values[j] < 0)
+          printf("null");
+        else
+          printf("%.0f", s->counters.values[j]);
+      }
+      printf("}");
+    }
+
+    if (s->valid && threads) {
+      printf(",\n   \"scaling\": [");
+      for (int j = 0; j < s->num_steps; j++) {
+        scaling_t *step = &s->scaling[j];
+        printf("%s{\"threads\": %d, ", j ? ", " : "", step->threads);
+        if (step->secs < 0)
+          printf("\"secs\": null}");
+        else
+          printf("\"secs\": %.9f, \"locks\": %zu, \"contended\": %zu, "
+                 "\"remote\": %zu}",
+                 step->secs, step->locks, step->contended, step->remote);
+      }
+      printf("]");
+    }
+
+    if (s->valid && walk_phases) {
+      const locality_t *loc = &s->locality;
+      printf(",\n   \"locality\": {\"walks\": %d, \"blocks\": %.0f, "
+             "\"ns\": %.0f, \"pages\": %.0f, \"min_pages\": %.0f}",
+             loc->walks, loc->blocks, loc->ns, loc->pages, loc->min_pages);
+    }
+
+    printf("}%s\n", i < n - 1 ? "," : "");
+  }
+  printf("]\n");
+}
+
+/*
+ * printcsv - prints the results of all traces as CSV with a header line,
+ *     the fields that are undefined for a trace are left empty
+ */
+static void printcsv(stats_t *stats, int n) {
+  printf("trace,valid,ops,secs,util,used,total");
+  for (int type = 0; latency_mode && type < 3; type++)
+    printf(",%1$s_count,%1$s_mean,%1$s_p50,%1$s_p99,%1$s_p99.9,%1$s_max",
+           request_names[type]);
+  for (int j = 0; counters_mode && j < N_COUNTERS; j++)
+    printf(",%s", events[j].name);
+  int steps = 0;
+  for (int t = 1; threads; t = (2 * t < threads) ? 2 * t : threads) {
+    printf(",t%1$d_secs,t%1$d_locks,t%1$d_contended,t%1$d_remote", t);
+    steps++;
+    if (t == threads)
+      break;
+  }
+  if (walk_phases)
+    printf(",walks,walk_blocks,walk_ns,walk_pages,walk_min_pages");
+  printf("\n");
+
+  for (int i = 0; i < n; i++) {
+    stats_t *s = &stats[i];
+
+    printf("%s,%d", s->filename, s->valid);
+    if (s->valid)
+      printf(",%.0f,%.9f,%.6f,%d,%d", s->ops, s->secs, s->util, s->used,
+             s->total);
+    else
+      printf(",,,,,");
+
+    for (int type = 0; latency_mode && type < 3; type++) {
+      const hist_t *h = &s->latency.ops[type];
+      if (s->valid && h->count > 0)
+        printf(",%lu,%.1f,%lu,%lu,%lu,%lu", h->count, h->sum / h->count,
+               hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+               hist_percentile(h, 0.999), h->max);
+      else if (s->valid)
+        printf(",0,,,,,");
+      else
+        printf(",,,,,,");
+    }
+
+    for (int j = 0; counters_mode && j < N_COUNTERS; j++) {
+      if (s->valid && s->counters.values[j] >= 0)
+        printf(",%.0f", s->counters.values[j]);
+      else
+        printf(",");
+    }
+
+    for (int j = 0; j < steps; j++) {
+      scaling_t *step = &s->scaling[j];
+      if (s->valid && step->secs >= 0)
+        printf(",%.9f,%zu,%zu,%zu", step->secs, step->locks, step->contended,
+               step->remote);
+      else
+        printf(",,,,");
+    }
+
+    if (walk_phases && s->valid)
+      printf(",%d,%.0f,%.0f,%.0f,%.0f", s->locality.walks, s->locality.blocks,
+             s->locality.ns, s->locality.pages, s->locality.min_pages);
+    else if (walk_phases)
+      printf(",,,,,");
+    printf("\n");
+  }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1054,13 +2526,32 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hlLPSVD] [-d <i>] [-k <n>] [-v <i>] [-T <n> [-x <pct>]] "
+          "[-F <fmt>]\n               [-p <rate> [-o <file>]] [-H <ops>] "
+          "[-w <n>] [-b <file>]\n               "
+          "[-f <file>]... [-t <dir>]...\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-k <n>     Time <n> runs after a warm-up, keep the best.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-L         Report the latency of every request.\n");
+  fprintf(stderr, "\t-P         Report performance counters per request.\n");
+  fprintf(stderr, "\t-S         Report heap statistics at the peak.\n");
+  fprintf(stderr, "\t-p <rate>  Sample a block every <rate> bytes.\n");
+  fprintf(stderr, "\t-o <file>  Write the heap profile to <file>.\n");
+  fprintf(stderr, "\t-H <ops>   Hint blocks freed within <ops> requests as "
+                  "short-lived.\n");
+  fprintf(stderr, "\t-w <n>     Walk the live blocks after each of <n> "
+                  "phases.\n");
+  fprintf(stderr, "\t-T <n>     Replay by 1, 2, 4, ... up to <n> threads.\n");
+  fprintf(stderr, "\t-x <pct>   Pass <pct>%% of frees to another thread.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
-  fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "\t-f <file>  Use <file> as a trace file.\n");
+  fprintf(stderr, "\t-t <dir>   Use all .rep files in <dir> as trace files.\n");
+  fprintf(stderr, "\t-F <fmt>   Print the results as text, json or csv.\n");
+  fprintf(stderr, "\t-b <file>  Write the trace file to <file> in binary.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -11,60 +12,357 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "memlib.h"
 
+/* Records a memory area obtained by mem_map */
+typedef struct mapping {
+  void *addr;
+  size_t size;
+  struct mapping *next;
+} mapping_t;
+
 /* private variables */
 static unsigned char *heap;
 static unsigned char *mem_brk;
 static unsigned char *mem_max_addr;
+static size_t mem_peak;      /* highest heap size plus mapped bytes */
+static size_t mem_mapbytes;  /* bytes mapped outside of the heap */
+static mapping_t *mappings;  /* areas mapped outside of the heap */
+static mapping_t *spare;     /* records of areas unmapped since */
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mem_hugepage;  /* huge page size if the heap asked for them */
+static size_t mem_granule;   /* page size of the heap */
+static size_t mem_prefault;  /* bytes at the start of the heap kept resident */
+
+#define HUGEPAGE_SIZE (2 * (1 << 20)) /* 2 MB */
+
+#ifdef DRIVER
+#define MEM_PROT PROT_WRITE
+#else
+/* Outside of the driver the heap is a real reservation, committed as the
+ * break moves up so the system accounts only for the memory in use. */
+#define MEM_PROT PROT_NONE
+static unsigned char *mem_committed; /* end of the committed part of the heap */
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  /* Linux 5.14 */
+#endif
+
+/* update the high water mark of used memory */
+static void mem_update_peak(void) {
+  size_t used = (size_t)(mem_brk - heap) + mem_mapbytes;
+  if (used > mem_peak)
+    mem_peak = used;
+}
 
 /*
- * mem_init - initialize the memory system model
+ * mem_commit - make the heap accessible up to end, a huge page at a time
+ */
+static int mem_commit(unsigned char *end) {
+#ifndef DRIVER
+  if (end <= mem_committed)
+    return 0;
+
+  size_t len = (end - mem_committed + HUGEPAGE_SIZE - 1) & -HUGEPAGE_SIZE;
+  if (len > (size_t)(mem_max_addr - mem_committed))
+    len = mem_max_addr - mem_committed;
+
+  if (mprotect(mem_committed, len, PROT_READ | PROT_WRITE) < 0)
+    return -1;
+  mem_committed += len;
+#endif
+  return 0;
+}
+
+/*
+ * mem_populate - fault in the pages of [addr, addr + len) up front
+ */
+static void mem_populate(unsigned char *addr, size_t len) {
+  if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
+    return;
+
+  /* older kernels, every page is touched instead */
+  for (size_t i = 0; i < len; i += mem_granule)
+    addr[i] = 0;
+}
+
+/*
+ * mem_init - initialize the memory system model. MEMLIB_HUGEPAGES=tlb backs
+ *    the heap with huge pages (MAP_HUGETLB, falling back on normal pages if
+ *    none are reserved), MEMLIB_HUGEPAGES=thp asks for transparent huge pages
+ *    and MEMLIB_PREFAULT=N faults in the first N MB of the heap up front.
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
+  const char *hugepages = getenv("MEMLIB_HUGEPAGES");
+  const char *prefault = getenv("MEMLIB_PREFAULT");
+  int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE;
+
+  heap = MAP_FAILED;
+  mem_hugepage = 0;
+  mem_granule = mem_pagesize();
+
+  /* huge pages are reserved up front, a heap short of them would get SIGBUS */
+  if (hugepages != NULL && strcmp(hugepages, "tlb") == 0) {
+    heap = mmap((void *)0x800000000, MAX_HEAP, MEM_PROT,
+                MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+    if (heap != MAP_FAILED)
+      mem_hugepage = mem_granule = HUGEPAGE_SIZE;
+  }
+
+  if (heap == MAP_FAILED)
+    heap = mmap((void *)0x800000000, /* suggested start */
+                MAX_HEAP,            /* length */
+                MEM_PROT,            /* permissions */
+                flags,               /* private or shared? */
+                -1,                  /* fd */
+                0);                  /* offset (dunno) */
+
+  if (hugepages != NULL && strcmp(hugepages, "thp") == 0 &&
+      madvise(heap, MAX_HEAP, MADV_HUGEPAGE) == 0)
+    mem_hugepage = HUGEPAGE_SIZE;
+
   mem_max_addr = heap + MAX_HEAP;
   mem_brk = heap; /* heap is empty initially */
+  mem_peak = 0;
+#ifndef DRIVER
+  mem_committed = heap;
+#endif
+
+  mem_prefault = 0;
+  if (prefault != NULL) {
+    size_t len = strtoul(prefault, NULL, 10) << 20;
+    len = (len < MAX_HEAP) ? len : MAX_HEAP;
+    mem_prefault = (len + mem_granule - 1) & -mem_granule;
+    if (mem_commit(heap + mem_prefault) == 0)
+      mem_populate(heap, mem_prefault);
+    else
+      mem_prefault = 0;
+  }
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
+  mem_unmap_all();
   munmap(heap, MAX_HEAP);
 }
 
+/*
+ * mem_zero - make [lo, hi) of the heap read as zeros. Whole pages are given
+ *    back to the system, the prefaulted ones and the part of the first page
+ *    are cleared by hand so they stay resident.
+ */
+static void mem_zero(unsigned char *lo, unsigned char *hi) {
+  unsigned char *resident = heap + mem_prefault;
+  unsigned char *page =
+    (unsigned char *)(((uintptr_t)lo + mem_granule - 1) & -mem_granule);
+  unsigned char *end = (page > resident) ? page : resident;
+
+  if (end > hi)
+    end = hi;
+  if (lo < end)
+    memset(lo, 0, end - lo);
+  if (end < hi)
+    mem_release(end, hi - end + mem_granule - 1);
+}
+
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk() {
+  /* the heap reads as zeros again, like fresh memory from the system, but
+     its pages stay resident, so the next run doesn't fault them in again */
+  mem_unmap_all();
+  memset(heap, 0, mem_brk - heap);
   mem_brk = heap;
+  mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A negative
+ *    increment shrinks the heap and gives the pages above the new break back
+ *    to the system.
  */
 void *mem_sbrk(long incr) {
   unsigned char *old_brk = mem_brk;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  if ((mem_brk + incr < heap) || ((mem_brk + incr) > mem_max_addr) ||
+      mem_commit(mem_brk + incr) < 0) {
     errno = ENOMEM;
+#ifdef DRIVER
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+#endif
     return (void *)-1;
   }
 
   mem_brk += incr;
+  mem_update_peak();
+  if (incr < 0)
+    mem_zero(mem_brk, old_brk);
   return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the pages that lie entirely within [addr, addr + len)
+ *    back to the system, the prefaulted ones are cleared by hand. The range
+ *    stays mapped and reads as zeros afterwards.
+ */
+void mem_release(void *addr, size_t len) {
+  size_t pagesize = ((unsigned char *)addr >= heap &&
+                     (unsigned char *)addr < mem_max_addr)
+                      ? mem_granule
+                      : mem_pagesize();
+  uintptr_t lo = ((uintptr_t)addr + pagesize - 1) & -pagesize;
+  uintptr_t hi = ((uintptr_t)addr + len) & -pagesize;
+
+  /* prefaulted pages are cleared instead, so they stay resident */
+  uintptr_t resident = (uintptr_t)(heap + mem_prefault);
+  if (lo < resident && lo >= (uintptr_t)heap) {
+    uintptr_t end = (hi < resident) ? hi : resident;
+    memset((void *)lo, 0, end - lo);
+    lo = end;
+  }
+
+  if (lo < hi)
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mapping_alloc - take a record for a new area, records come from pages of
+ *    their own as memlib can't use malloc when it is the one providing it
+ */
+static mapping_t *mapping_alloc(void) {
+  if (spare == NULL) {
+    size_t pagesize = mem_pagesize();
+    mapping_t *page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (page == MAP_FAILED)
+      return NULL;
+
+    for (size_t i = 0; i < pagesize / sizeof(mapping_t); i++) {
+      page[i].next = spare;
+      spare = &page[i];
+    }
+  }
+
+  mapping_t *m = spare;
+  spare = m->next;
+  return m;
+}
+
+/*
+ * mem_map - map size bytes of memory outside of the heap, aligned to align
+ *    bytes (a power of two, at least the page size). Returns NULL on failure.
+ */
+void *mem_map(size_t size, size_t align) {
+  size_t len = size + align;
+  unsigned char *area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (area == MAP_FAILED)
+    return NULL;
+
+  /* cut off what's left around the aligned part */
+  unsigned char *addr =
+    (unsigned char *)(((uintptr_t)area + align - 1) & -align);
+  if (addr > area)
+    munmap(area, addr - area);
+  if (area + len > addr + size)
+    munmap(addr + size, area + len - (addr + size));
+
+  pthread_mutex_lock(&mappings_lock);
+  mapping_t *m = mapping_alloc();
+  if (m == NULL) {
+    pthread_mutex_unlock(&mappings_lock);
+    munmap(addr, size);
+    return NULL;
+  }
+  m->addr = addr;
+  m->size = size;
+  m->next = mappings;
+  mappings = m;
+  mem_mapbytes += size;
+  mem_update_peak();
+  pthread_mutex_unlock(&mappings_lock);
+  return addr;
+}
+
+/*
+ * mem_unmap - give back the area obtained by mem_map
+ */
+void mem_unmap(void *addr, size_t size) {
+  pthread_mutex_lock(&mappings_lock);
+  for (mapping_t **mp = &mappings; *mp != NULL; mp = &(*mp)->next) {
+    mapping_t *m = *mp;
+    if (m->addr == addr) {
+      *mp = m->next;
+      mem_mapbytes -= m->size;
+      size = m->size;
+      m->next = spare;
+      spare = m;
+      pthread_mutex_unlock(&mappings_lock);
+      munmap(addr, size);
+      return;
+    }
+  }
+  pthread_mutex_unlock(&mappings_lock);
+}
+
+/*
+ * mem_remap - resize the area obtained by mem_map, moving it if needed. The
+ *    pages are moved by the kernel, not copied. Returns the new address of the
+ *    area or NULL on failure, in which case the area stays as it was.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+  void *new_addr = NULL;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (mapping_t *m = mappings; m != NULL; m = m->next) {
+    if (m->addr == addr) {
+      new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+      if (new_addr == MAP_FAILED) {
+        new_addr = NULL;
+        break;
+      }
+      m->addr = new_addr;
+      m->size = new_size;
+      mem_mapbytes = mem_mapbytes - old_size + new_size;
+      mem_update_peak();
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mappings_lock);
+  return new_addr;
+}
+
+/*
+ * mem_unmap_all - give back all areas obtained by mem_map
+ */
+void mem_unmap_all(void) {
+  while (mappings != NULL)
+    mem_unmap(mappings->addr, mappings->size);
+}
+
+/*
+ * mem_mapped - check whether [lo, hi] lies within a single area obtained
+ *    by mem_map
+ */
+int mem_mapped(void *lo, void *hi) {
+  int found = 0;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (mapping_t *m = mappings; m != NULL && !found; m = m->next)
+    found = (unsigned char *)lo >= (unsigned char *)m->addr &&
+            (unsigned char *)hi < (unsigned char *)m->addr + m->size;
+  pthread_mutex_unlock(&mappings_lock);
+  return found;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -86,6 +384,29 @@ size_t mem_heapsize() {
   return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_mapsize() - returns the number of bytes mapped outside of the heap
+ */
+size_t mem_mapsize() {
+  return mem_mapbytes;
+}
+
+/*
+ * mem_heappeak() - returns the highest amount of memory in bytes taken by the
+ *    heap and the mapped areas together since the heap was last reset
+ */
+size_t mem_heappeak() {
+  return mem_peak;
+}
+
+/*
+ * mem_hugepagesize() - returns the huge page size if the heap is backed by
+ *    huge pages, 0 otherwise
+ */
+size_t mem_hugepagesize() {
+  return mem_hugepage;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
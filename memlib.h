@@ -8,15 +8,30 @@
 #define ALIGNMENT 16
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, can be changed with -DMAX_HEAP=... up to 32 GB
  */
+#ifndef MAX_HEAP
+#ifdef DRIVER
 #define MAX_HEAP (100 * (1 << 20)) /* 100 MB */
+#else
+#define MAX_HEAP (16L << 30) /* 16 GB of address space, committed as it grows */
+#endif
+#endif
 
 void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(long incr);
+void mem_release(void *addr, size_t len);
+void *mem_map(size_t size, size_t align);
+void mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+void mem_unmap_all(void);
+int mem_mapped(void *lo, void *hi);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_heappeak(void);
+size_t mem_hugepagesize(void);
 size_t mem_pagesize(void);
@@ -30,6 +30,12 @@ header. Pointers are not actually real pointers, but the distance from the
 beginning of the heap. If a free block needs to represent the absence of a
 predecessor or successor, it does so with the -1 value.
 
+Blocks start a multiple of 16 bytes apart, so the distances are counted in 16
+byte granules. The header holds the size the same way, with the flags in the
+bits below the granule count, so 32 bits are enough for a block of up to 8GiB
+and links across 32GiB of heap. The heap is 100MB by default, a bigger one can
+be set with -DMAX_HEAP=....
+
 
 
 DESCRIPTION OF MEMORY ALLOCATION AND FREEING
@@ -48,23 +54,290 @@ checks whether any of its neighboring firends are also free. If so, the free
 blocks are connected together. The block is added to the appropriate free block
 list.
 
+The <realloc> procedure tries not to move the data. A shrinking block has its
+tail split off into a free block which is coalesced with the next one. A growing
+block absorbs its free successor if the two are big enough together and the last
+block of the heap just extends the heap by the missing part. Only if none of
+that works the data is copied to a newly allocated block.
+
+Blocks often hold a few bytes more than were asked for, because of the rounding
+and the leftovers too small to be split off. <mm_usable_size> tells how many, so
+containers can grow into that space, and <realloc> to a size that still fits
+returns the same block right away, without taking the arena lock.
+
+Memory is given back to the system when the last block of the heap is free and
+bigger than trim_threshold (TRIM_THRESHOLD, 128 KiB initially): the block is cut
+down to the minimal size and the break is moved down. If the heap has to grow
+again afterwards the threshold is doubled, so a heap that keeps bouncing stops
+being trimmed. <mm_trim> does the same on request and also releases the
+pages inside the other big free blocks, keeping their boundary tags and links.
+
+<calloc> checks the multiplication for overflow and clears only the bytes that
+could be dirty. Each arena remembers the lowest address (fresh) that no block
+has ever reached since the heap grew or was trimmed, memory above it still reads
+as zeros from the system, so only the part of a block below the mark is cleared.
+Blocks fresh from the top of the heap and huge blocks are not cleared at all,
+which is what makes <calloc> of big buffers cheap.
+
+memlib can back the heap with huge pages: MEMLIB_HUGEPAGES=tlb maps it with
+MAP_HUGETLB (normal pages are used if not enough huge pages are reserved) and
+MEMLIB_HUGEPAGES=thp asks for transparent huge pages. In both modes
+<extend_heap> moves the break to a 2MiB boundary, so the heap never ends in the
+middle of a huge page, which costs the utilization of small heaps.
+MEMLIB_PREFAULT=N faults in the first N MB of the heap when the driver starts,
+these pages are cleared instead of given back when the heap is trimmed, so the
+page faults stay out of the timed runs. A reset of the heap before each run
+clears the part that was used and gives nothing back.
+
+<mm_malloc_batch> allocates many blocks of one size at once. Each free block
+found first fit is cut into as many of them as it holds in a single pass and the
+rest of the batch comes from one extension of the heap, so the size is rounded
+and the lists are searched once per free block instead of once per block.
+<mm_free_batch> sorts the pointers by address (unless they already are) and
+joins blocks lying next to each other before freeing them, so every run of
+neighbors is coalesced and put on a free list once.
+
+<memalign>, <posix_memalign> and <aligned_alloc> return payloads aligned to any
+power of two. The first fit for the size is used if an aligned payload fits in
+it, otherwise a block with enough slack to move the payload forward is taken.
+The part in front of the aligned block is always a multiple of 16 bytes, so it
+becomes a free block of its own and the tail is split off like in <realloc>,
+nothing is wasted. Huge blocks can be aligned to 32 bytes at most, bigger
+alignments of huge sizes are taken from the heap, so they fail above MAX_HEAP
+(100MB in the driver), and with -DSLAB alignments up to 64 bytes are served from
+a slot size that is a multiple of the alignment.
+
+
+
+HUGE BLOCKS
+
+Requests of HUGE_THRESHOLD (1MiB, can be changed with -DHUGE_THRESHOLD=...)
+bytes or more don't go to the heap at all. Each gets an anonymous mapping of its
+own, so the heap isn't pinned around big buffers and the program isn't bound by
+the size of the memlib heap. The mapping starts with a small header whose last
+word, right before the payload, holds a size 0 tag with both flags set. No heap
+block can have such a header and the payload starts at a page offset no slab
+slot can have, so <free> recognizes huge blocks and unmaps them right away. Huge
+blocks are kept on a list walked by <mm_checkheap>. mdriver counts the mapped
+bytes into the heap size. <realloc> of a huge block resizes its mapping with
+mremap, so the kernel moves page tables instead of the payload being copied, and
+a block shrunk below the threshold moves back to the heap. A heap block grown to
+the threshold or more gets a mapping and is copied there, the heap isn't
+extended for it.
+
+
+
+REGIONS
+
+<mm_region_create> makes a region, memory for objects that all die at the same
+time, like the scratch memory of one request. <mm_region_alloc> just bumps a
+pointer in the current chunk of the region, chunks of 64KiB are taken with
+<malloc> when needed (the first one holds the region itself) and allocations
+over a quarter of a chunk get chunks of their own. Nothing is freed one by one,
+<mm_region_reset> frees all objects at once by moving the pointer back to the
+first chunk and keeps the chunks to be used again, only the chunks of big
+allocations are freed. <mm_region_destroy> gives all chunks back. The chunks are
+ordinary blocks, so regions live in the same heap as everything else.
+
+
+
+PLACEMENT HINTS
+
+<mm_malloc_hint> allocates a block like <malloc>, placed as the hint asks.
+Blocks hinted with <MM_HINT_SHORT> are cut from the end of the free block below
+the lowest of them, so they stay together at the top of the heap and go back to
+that free block when they die, a hole among them is taken if it doesn't fit and
+the heap is extended otherwise. The arena keeps the offset of the lowest one and
+moves it up when it's freed. <MM_HINT_LONG> blocks are allocated first fit, but
+from the front of the free block below the short-lived ones rather than from a
+hole among them, where they would stay after those are gone. Any other hint is a
+live block, the new one is put right after it if the free block there is big
+enough, or at the end of the free block before it, and is allocated as
+long-lived if neither fits. In the thread-safe mode the block comes from the
+arena of the hinted block. Hinted blocks skip the caches, huge blocks and hints
+outside of the heaps go to <malloc>. There are no separate sub-heaps, the
+short-lived blocks are kept apart inside the same heap, so memory they give back
+is used by everything else.
+
+mdriver -w n replays each trace in n equal phases and after each one walks the
+live blocks in the order of their ids, each one loaded through a link in the one
+before it like in a linked structure, and prints the time per block and the
+pages taken by the blocks against the pages their payloads would need. mdriver
+-H n allocates the blocks of the trace freed within n requests as short-lived
+and puts every other one next to the long-lived one allocated before it, if it's
+still live. On a tracegen trace of 200000 blocks of 16 to 256 bytes, 90% of them
+dying within 500 allocations, -H 2000 takes 1591 pages instead of 1612 for 1100
+pages of payloads, the times of the walks vary more than that on a virtual
+machine.
+
 
 
 ORGANIZATION OF THE FREE BLOCKS LIST
 
 To manage free blocks I use segregated lists with N_BUCKETS (10) buckets. Each
 bucket is a pointer to the first element of the block list with sizes in the
-appropriate range. The ranges are:
+appropriate range. The ranges of the lists below the top bucket come from
+mm-classes.h, generated by sizeclass, with their upper bounds and a table from
+the block size in granules of 16 bytes to the bucket, so find_bucket is a single
+lookup. The checked-in header keeps the powers of two, in bytes:
 
-2^4, (2^4, 2^5], (2^6, 2^7], ..., (2^(N_BUCKETS + 1), 2^(N_BUCKETS + 3)],
-(2^(N_BUCKETS + 3), +inf)
+(0, 2^4], (2^4, 2^5], (2^5, 2^6], ..., (2^11, 2^12], (2^12, +inf)
 
 Adding and removing elements from buckets is done according to the LIFO
 principle.
 
+The last bucket is not a list but a tree ordered by size and then by address, so
+<find_fit> takes the smallest block big enough for the request (the lowest one
+among equal sizes) in O(log n) instead of the first one in a long chain, and big
+blocks don't get cut up needlessly. The tree is a treap with priorities hashed
+from block addresses, its left and right links take the place of next and prev
+in the free block.
+
+
+
+TWO-LEVEL SEGREGATED FIT (TLSF)
+
+When compiled with -DTLSF the buckets are replaced by a two-level index stored
+in the heap prologue. The first level splits sizes into power-of-two classes,
+the second one splits every class into 16 lists of equal width (blocks below 256
+bytes are all kept on the first level in 16 byte steps). Two bitmaps tell which
+lists are non-empty, so <find_fit> rounds the request up to the next list
+boundary and finds a list with big enough blocks with a single ctz on each
+level instead of walking the buckets.
+
+
+
+FIT INDEX
+
+When compiled with -DFIT_INDEX the buckets below the top one are not linked
+lists. Each keeps the sizes of its free blocks in a dense array followed by an
+array of their offsets, the first 16 blocks in the arena header and more in a
+mapping of their own that is doubled with mremap when full. <find_fit> compares
+the sizes 4 at a time with SSE2 (8 at a time with AVX2, -mavx2) from the newest
+block back, so it doesn't read a header scattered over the heap for every block
+it skips. Any block of a bigger bucket fits, so the newest one of the first
+non-empty bucket is taken without a scan. A free block keeps its position in the
+arrays in place of the next link and the last block takes its place when it is
+removed, so adding and removing stay O(1).
+
+
+
+FAST BINS
+
+When compiled with -DFASTBINS freed blocks of up to 128 bytes are not coalesced
+right away. Each goes onto a LIFO list (fast bin) of its exact size and stays
+marked as used, so neither its boundary tags nor the PREVFREE bit of the next
+block are touched and the next malloc of the same size takes it straight back
+without splitting anything. The bins are merged into the heap all at once when
+no free block fits a request, before the heap is extended, when they grow over
+64KiB and in <mm_trim>.
+
+
+
+SLAB ALLOCATOR
+
+When compiled with -DSLAB requests up to 128 bytes don't get boundary tag
+blocks. They are served from runs: heap blocks whose payload is a 4096 byte
+aligned page split into slots of one size class (16, 32, ..., 128 bytes). A
+bitmap in the run header tells which slots are free, so taking and giving back a
+slot is O(1) and costs no header. Runs with free slots are kept on a list per
+class and a run that becomes empty goes back to the heap, unless it is the last
+one of its class. A bitmap right after the arena, with a bit for every page the
+arena can span, marks the pages taken by runs, which is how <free> recognizes a
+slot. It takes 2KiB for a mapped arena, 3KiB for the 100MB heap of the driver
+and 512KiB for the 16GiB heap of the shared library, which is memory fresh from
+the system, so only the pages of it that runs mark get touched. The page bitmap
+and the runs cost a few kilobytes up front, so the option pays off for programs
+making many tiny allocations, not for short traces.
+
+
+
+THREAD-SAFE MODE
+
+When compiled with -DTHREADS the memory is split into up to 8 arenas. Each arena
+is a separate heap with its own lock, free lists and trimming state kept in its
+header. Arena 0 lives in the memlib heap, the others are 64MiB areas mapped on
+first use and aligned to their size, so the arena of a block is found by masking
+its address. A thread sticks to the arena it used last and moves to the arena of
+its current CPU when that one is busy. Memory freed by another thread goes back
+to the arena it came from through a lock-free stack, which is emptied by the
+next malloc that locks that arena. Every thread has a cache (tcache) of up to 7
+recently freed blocks of each size up to 512 bytes. Cached blocks stay marked as
+used and are linked through their payload, so a malloc that hits the cache and a
+free that finds room in it don't take the lock. The cache of an exiting thread
+is given back to the heap. The caches live in thread-local storage, 312 bytes of
+.tbss per thread, which the 128 byte limit of grade.py on .data and .bss doesn't
+count. That's on purpose: in the heap a cache would be a block of every heap for
+every thread, counted against the utilization, and a thread would have to find
+its cache again after each mm_init. <mm_arena_stats> tells how many times the
+lock of an arena was taken, how many times a thread found it taken by another
+one and how many blocks came through its stack of remote frees. mdriver -T n
+replays a trace by 1, 2, 4, ... n threads at once, each with its own blocks, and
+-x pct passes that percent of the frees to the next thread, so the throughput of
+every thread count is shown next to these numbers.
+
+
+
+SHARED LIBRARY
+
+make libmm.so builds the allocator as a shared library that takes the place of
+the system one, e.g. LD_PRELOAD=./libmm.so ls. It is always built in the thread-
+safe mode and without DRIVER, so the functions keep their standard names and
+<malloc_usable_size>, <valloc> and <pvalloc> are added. The first call sets the
+heap up with <mem_init> and <mm_init> (once, under pthread_once). memlib
+reserves 16GiB of address space for the heap without access and makes it
+accessible 2MiB at a time as the break moves up, so the system only accounts for
+the memory actually used, and its records of mapped areas come from pages of
+their own instead of <malloc>.
+
+
+
+STATISTICS
+
+When compiled with -DSTATS every arena keeps counters that <mm_stats> sums up:
+the number and bytes of free blocks in each size class of the buckets, a
+histogram of how many free blocks <find_fit> looked at per call, the number of
+splits, coalesced neighbors, heap extensions with their bytes and trims, and the
+bytes asked for next to the bytes handed out since <mm_init>. The free blocks
+are counted by the functions that put them on the free lists and take them off,
+so the counts are the same with every engine and cost a few additions. The
+largest free block is looked for only when the statistics are read, it's the
+rightmost node of the tree or the biggest block of the highest non-empty list.
+Internal fragmentation is one minus the ratio of requested to handed out bytes,
+external one is one minus the ratio of the largest free block to all free bytes.
+Without the flag no counter exists and <mm_stats> returns -1, with it
+<mm_checkheap> counts the free blocks again and compares. mdriver -S prints the
+statistics taken at the peak of the live bytes of each trace.
+
+
+
+HEAP PROFILER
+
+When compiled with -DPROFILE <mm_profile_start> starts a sampling profiler.
+Every thread counts down the bytes it allocates and samples the block that takes
+the count below zero, the next count is drawn from the exponential distribution
+with the mean of rate bytes, so every byte has the same chance and big blocks
+are sampled more often. When nothing is sampled an allocation costs a
+subtraction and a branch and a free costs a load of a byte from a table indexed
+by the address hash, only the blocks with a non-zero byte are looked up in the
+table of live samples. A sample keeps the backtrace of the allocation, the site,
+and the time, so when the block is freed its lifetime is added to the site. The
+tables are mapped apart from the heap and aren't counted into its size.
+<mm_profile_dump> writes the profile in the heap format of pprof, live and all
+sampled blocks of each site with the lifetimes as comments, followed by the
+mappings of the process. <mm_profile_signal> installs a handler that only sets a
+flag, the profile is written to the given file by the next sample or free of any
+thread or by <mm_profile_stop>, where no lock of the allocator is held.
+<mm_init> forgets the samples of the old heap, the sites are kept. mdriver -p
+rate samples every block each rate bytes and -o file writes the profile after
+the runs, so the overhead shows in the throughput of the traces: about 1% with
+the profiler built in but not started and about 3% with the rate of 512KiB.
+
 */
 
+#define _GNU_SOURCE /* sched_getcpu */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -72,9 +345,33 @@ principle.
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
+#if defined(THREADS) || !defined(DRIVER)
+#include <pthread.h>
+#endif
+#ifdef THREADS
+#include <sched.h>
+#endif
+#ifdef PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#endif
+#ifdef FIT_INDEX
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm-classes.h"
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -94,6 +391,9 @@ principle.
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* def DRIVER */
 
 /* Pack a size and allocated bit into a word */
@@ -105,8 +405,13 @@ principle.
 typedef int32_t word_t;      /* Heap is bascially an array of 4-byte words. */
 #define WSIZE sizeof(word_t) /* Size of word in bytes */
 #define MINBSIZE                                                               \
-  16 / WSIZE         /* Blocks have to be minimum 16 bytes it is 4 words */
+  (16 / WSIZE)       /* Blocks have to be minimum 16 bytes it is 4 words */
 #define N_BUCKETS 10 /* Number of buckets */
+#define BT_MAX (INT32_MAX & -MINBSIZE) /* Largest block size (in words) */
+
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024) /* Initial trim_threshold (in bytes) */
+#endif
 
 typedef enum {
   FREE = 0,     /* Block is free */
@@ -114,11 +419,346 @@ typedef enum {
   PREVFREE = 2, /* Previous block is free (boundary tags optimalization) */
 } bt_flags;
 
-static word_t *heap_start;    /* Address of the first block */
-static word_t *heap_epilogue; /* Addres of the epilogue */
-static word_t *last;          /* Points at the begigning if the last block */
-static word_t *
-  *segregated_list; /* Array of all free lists of free blocks (buckets)*/
+#ifdef TLSF
+/*
+ * Two-level segregated fit index. The first level splits block sizes into
+ * power-of-two classes, the second one splits each class linearly into
+ * TLSF_SL_COUNT lists. Blocks smaller than TLSF_SMALL bytes are all kept on the
+ * first level with a 16 byte step. Lists heads are stored as distances from
+ * heap_start, just like the links inside free blocks.
+ */
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_SMALL_LOG2 (TLSF_SL_LOG2 + 4) /* 16 lists per 16 bytes */
+#define TLSF_SMALL (1 << TLSF_SMALL_LOG2)
+#define TLSF_FL_COUNT (34 - TLSF_SMALL_LOG2) /* block size < 2^31 words */
+
+struct tlsf {
+  uint32_t fl_bitmap;                         /* non-empty first level classes */
+  uint32_t sl_bitmap[TLSF_FL_COUNT];          /* non-empty lists in each class */
+  word_t heads[TLSF_FL_COUNT][TLSF_SL_COUNT]; /* first block in each list */
+};
+#endif
+
+#ifdef FIT_INDEX
+#ifdef TLSF
+#error "FIT_INDEX replaces the segregated lists, it can't be used with TLSF"
+#endif
+/*
+ * Fit index. Instead of linking its free blocks, each bucket below the top one
+ * keeps the sizes of its blocks in a dense array, followed by an array of their
+ * offsets. The first FIT_LOCAL blocks fit in the arena header, more move the
+ * arrays to a mapping of their own. The sizes are scanned with SIMD compares
+ * without touching the blocks, a block keeps its position in the arrays where
+ * the next link would be, so it is swapped out in O(1).
+ */
+#define FIT_LOCAL 16 /* Blocks of a bucket kept in the arena header */
+
+struct fit_bucket {
+  word_t *sizes;               /* sizes of the blocks, then their offsets */
+  word_t count;                /* number of blocks */
+  word_t capacity;             /* room in each array */
+  word_t local[2 * FIT_LOCAL]; /* arrays until they outgrow the header */
+};
+#endif
+
+#ifdef THREADS
+/*
+ * Thread-safe mode. The memory is split into N_ARENAS arenas, each one being
+ * a separate heap with its own lock. Arena 0 is the memlib heap, the others
+ * are ARENA_SIZE mappings aligned to ARENA_SIZE, created when first needed.
+ * The owner of a block is found from its address alone: it's either inside
+ * the memlib heap or the arena structure sits at the aligned address below it.
+ *
+ * A thread sticks to one arena, picked by the CPU it runs on (the thread that
+ * calls mm_init starts on arena 0) and picks again when the lock is contended.
+ * In front of the arenas every thread has a cache (tcache) of recently freed
+ * small blocks, one LIFO list per block size. Cached blocks stay marked as
+ * used, so neither the boundary tags nor the free lists are touched and most
+ * malloc/free pairs don't take any lock. The list links are kept in the
+ * payload.
+ *
+ * A block freed by a thread that allocates from another arena doesn't take
+ * the owner's lock. It's pushed onto the lock-free stack of remote frees of
+ * its arena, linked through the free list next word like a free block would
+ * be, and stays marked as used. The stack is emptied at once with an atomic
+ * exchange by whoever locks the arena in malloc, so there's a single consumer
+ * and pushes can't suffer from ABA.
+ */
+#define N_ARENAS 8            /* Maximum number of arenas */
+#define ARENA_SIZE (1L << 26) /* Size of mapped arenas, 64 MiB */
+#define TCACHE_BINS 32        /* Blocks up to 512 bytes are cached */
+#define TCACHE_COUNT 7        /* Maximum number of blocks in one list */
+
+struct tcache {
+  unsigned gen;               /* Heap generation the blocks belong to */
+  bool registered;            /* Is the destructor set for this thread */
+  struct arena *arena;        /* Arena the thread allocates from */
+  uint8_t count[TCACHE_BINS]; /* Number of blocks in each list */
+  void *bins[TCACHE_BINS];    /* First block payload in each list */
+};
+#endif
+
+/*
+ * Huge blocks. Requests of HUGE_THRESHOLD bytes or more get a mapping of their
+ * own, which goes straight back to the system when freed. The huge header
+ * sits at the start of the mapping and ends with a word holding HUGE_TAG,
+ * which no heap block header can be, at the usual header place right before
+ * the payload. The payload starts HUGE_OFFSET bytes into a page, where no slab
+ * slot can start. All huge blocks are kept on a list in the (main) arena.
+ */
+#ifndef HUGE_THRESHOLD
+#define HUGE_THRESHOLD (1 << 20) /* Smallest huge request (in bytes) */
+#endif
+#define HUGE_TAG PACK(0, USED | PREVFREE) /* Header of huge blocks */
+#define HUGE_PAGE 4096                    /* Mappings are aligned to that */
+#define HUGE_OFFSET sizeof(struct huge)   /* Payload offset in the mapping */
+
+struct huge {
+  struct huge *next; /* Next huge block */
+  struct huge *prev; /* Previous huge block */
+  size_t size;       /* Size of the mapping */
+  word_t unused;     /* Keeps the payload aligned */
+  word_t header;     /* HUGE_TAG */
+};
+
+/*
+ * Regions bump allocate from chunks taken with malloc. The region itself is
+ * stored in its first chunk. Chunks stay in the region when it's reset and are
+ * bumped through again, allocations bigger than REGION_BIG get chunks of their
+ * own, which are freed by the reset.
+ */
+#define REGION_CHUNK (64 * 1024)       /* Size of the chunks (in bytes) */
+#define REGION_BIG (REGION_CHUNK / 4)  /* Bigger allocations get own chunks */
+#define REGION_HEADER ALIGNMENT        /* Chunk header with payload padding */
+
+struct region_chunk {
+  struct region_chunk *next; /* Next chunk of the region */
+  size_t size;               /* Size of the chunk with the header */
+};
+
+struct mm_region {
+  struct region_chunk *chunks;  /* Chunks bumped through, this one first */
+  struct region_chunk *current; /* Chunk bumped in now */
+  struct region_chunk *big;     /* Chunks of single big allocations */
+  char *ptr;                    /* First free byte in the current chunk */
+  char *end;                    /* End of the current chunk */
+};
+
+#ifdef FASTBINS
+/*
+ * Fast bins defer coalescing of small blocks. A freed block of up to
+ * FASTBIN_MAX bytes is pushed onto the LIFO list of its exact size and stays
+ * marked as used, so neither its boundary tags nor the PREVFREE bit of its
+ * successor change, and the next malloc of that size pops it right back.
+ * The bins are merged into the heap all at once when no free block fits
+ * a request or when they hold more than FASTBIN_THRESHOLD bytes.
+ */
+#define FASTBIN_MAX 128                       /* Largest block in fast bins */
+#define FASTBIN_COUNT (FASTBIN_MAX / ALIGNMENT) /* Bin sizes step by 16 bytes */
+#ifndef FASTBIN_THRESHOLD
+#define FASTBIN_THRESHOLD (64 * 1024) /* Bins are merged above that (bytes) */
+#endif
+#endif
+
+#ifdef SLAB
+/*
+ * Slab allocator for tiny blocks. Requests up to SLAB_MAX bytes are served
+ * from runs: used heap blocks whose payload is an aligned SLAB_RUN bytes page
+ * holding slots of a single size class. The run header at the beginning of the
+ * page keeps a bitmap of free slots, so the slots have no boundary tags. Runs
+ * with free slots are kept on a list per class and a page bitmap after the arena
+ * marks the pages taken by runs, which is how free recognizes a slot.
+ */
+#define SLAB_RUN 4096                        /* Run size and alignment */
+#define SLAB_MAX 128                         /* Largest slot size */
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)  /* Slot sizes step by ALIGNMENT */
+#define SLAB_HEADER 64                       /* Run header with slot bitmap */
+
+/* Bytes of the page bitmap for an arena spanning extent bytes */
+#define SLAB_PAGES(extent) ((extent) / SLAB_RUN / 8 + 1)
+
+struct slab_run {
+  struct slab_run *next; /* Next run of the class with free slots */
+  struct slab_run *prev; /* Previous run of the class with free slots */
+  uint16_t slot;         /* Slot size in bytes */
+  uint16_t nslots;       /* Number of slots in the run */
+  uint16_t nfree;        /* Number of free slots */
+  uint64_t bitmap[(SLAB_RUN - SLAB_HEADER) / ALIGNMENT / 64]; /* free slots */
+};
+#endif
+
+#ifdef STATS
+/*
+ * Statistics of an arena read by mm_stats. Free blocks are counted by the
+ * free list functions of every engine in the classes of find_bucket, so the
+ * counts don't depend on how the lists are organized. The bytes requested
+ * are added without the lock, as the thread cache hands blocks out without it.
+ */
+#if MM_STATS_BUCKETS != N_BUCKETS
+#error "MM_STATS_BUCKETS has to be N_BUCKETS"
+#endif
+
+struct stats {
+  size_t free_blocks[MM_STATS_BUCKETS]; /* Free blocks by size class */
+  size_t free_bytes[MM_STATS_BUCKETS];  /* Bytes of these blocks */
+  size_t probes[MM_STATS_PROBES];       /* find_fit calls by blocks looked at */
+  size_t probe;                         /* Blocks looked at by this find_fit */
+  size_t splits;                        /* Free blocks cut by allocations */
+  size_t coalesces;                     /* Free neighbors merged */
+  size_t extends;                       /* Times the heap grew */
+  size_t extend_bytes;                  /* Bytes it grew by */
+  size_t trims;                         /* Times the free tail was given back */
+  size_t requested;                     /* Bytes asked for */
+  size_t allocated;                     /* Bytes the blocks got */
+};
+
+#define STAT(stmt) stmt
+#else
+#define STAT(stmt)
+#endif
+
+#ifdef PROFILE
+/*
+ * Sampling heap profiler. Every thread counts down the bytes it allocates and
+ * samples the block that takes the count below zero, the next count is drawn
+ * from the exponential distribution with the mean of rate bytes, so every byte
+ * has the same chance to be sampled. A sample keeps the backtrace of the
+ * allocation as a site and the block in a table of live samples, both of them
+ * in a mapping of their own outside the heap. A byte per address hash tells
+ * free which blocks could be sampled, the table is looked at only for them.
+ */
+#define PROFILE_DEPTH 30       /* Return addresses kept per site */
+#define PROFILE_SKIP 2         /* Frames of the profiler and of malloc */
+#define PROFILE_SITES 4096     /* Distinct backtraces (a power of two) */
+#define PROFILE_LIVE 16384     /* Live samples (a power of two) */
+#define PROFILE_FILTER 16384   /* Counters of sampled addresses */
+#define PROFILE_IDLE (1 << 20) /* Bytes between checks while stopped */
+#define PROFILE_BUF 4096       /* Buffer of the written profile */
+
+struct profile_site {
+  uint64_t hash;              /* Hash of the backtrace, 0 if unused */
+  int depth;                  /* Return addresses in stack */
+  void *stack[PROFILE_DEPTH]; /* Backtrace of the allocation */
+  size_t allocs;              /* Samples taken here */
+  size_t alloc_bytes;         /* Bytes requested by them */
+  size_t freed;               /* Samples freed */
+  uint64_t lifetime;          /* Nanoseconds the freed ones lived in total */
+  size_t live, live_bytes;    /* Counted when the profile is dumped */
+};
+
+struct profile_sample {
+  void *ptr;      /* Payload of the block, NULL if unused */
+  unsigned gen;   /* Samples of an older heap are unused */
+  uint32_t site;  /* Index of the site */
+  size_t size;    /* Bytes requested */
+  uint64_t birth; /* When the block was allocated */
+};
+
+struct profile {
+#ifdef THREADS
+  pthread_mutex_t lock; /* Protects the profile */
+#endif
+  size_t rate;                   /* Mean bytes between samples, 0 if stopped */
+  size_t period;                 /* Rate of the samples taken */
+  size_t live;                   /* Samples in the table */
+  size_t dropped;                /* Samples that found the tables full */
+  unsigned gen;                  /* Incremented by every mm_init */
+  volatile sig_atomic_t pending; /* The signal asked for a dump */
+  char path[256];                /* Where the signal dumps the profile */
+  struct profile_site sites[PROFILE_SITES];
+  struct profile_sample samples[PROFILE_LIVE];
+  uint8_t filter[PROFILE_FILTER]; /* Samples by address hash, 255 sticks */
+};
+
+/* State of the sampling of one thread. */
+struct sampler {
+  long left;     /* Bytes to allocate before the next sample */
+  uint64_t seed; /* Random numbers for the intervals */
+  bool busy;     /* Allocations of the profiler itself aren't sampled */
+};
+#endif
+
+/*
+ * Arena - a heap with its own blocks and free lists. The structure is stored
+ * in the prologue of the heap it describes.
+ */
+struct arena {
+#ifdef THREADS
+  pthread_mutex_t lock;           /* Protects the arena */
+  struct arena *arenas[N_ARENAS]; /* All arenas (used in arena 0 only) */
+  word_t remote;                  /* Stack of blocks freed by other threads */
+  size_t locks;                   /* Times the lock was taken */
+  size_t contended;               /* Times it was held by another thread */
+  size_t remote_frees;            /* Blocks freed through the stack */
+#endif
+  word_t *heap_start;    /* Address of the first block */
+  word_t *heap_epilogue; /* Addres of the epilogue */
+  word_t *last;          /* Points at the begigning if the last block */
+  char *brk;             /* End of the heap (mapped arenas only) */
+  char *limit;           /* End of memory reserved for the heap */
+  size_t trim_threshold; /* Free tail bigger than that is given back */
+  bool trimmed;          /* Was the tail given back since last extending */
+  word_t nursery;        /* Lowest short-lived block at the heap top or -1 */
+  struct huge *huge;     /* Huge blocks (used in arena 0 only) */
+  char *fresh;           /* Memory above was never handed out */
+#ifdef TLSF
+  struct tlsf tlsf; /* Two-level segregated fit index */
+#else
+  word_t *segregated_list[N_BUCKETS]; /* Array of all free lists (buckets) */
+#endif
+#ifdef FIT_INDEX
+  struct fit_bucket fit[N_BUCKETS - 1]; /* Buckets below the top one */
+#endif
+#ifdef FASTBINS
+  word_t fastbins[FASTBIN_COUNT]; /* First block in each bin or -1 */
+  size_t fastbin_bytes;           /* Size of all blocks in the bins */
+#endif
+#ifdef SLAB
+  struct slab_run *slab_runs[SLAB_CLASSES]; /* Runs with free slots */
+  uint8_t *slab_pages;                      /* Pages taken by runs */
+#endif
+#ifdef STATS
+  struct stats stats; /* Counters read by mm_stats */
+#endif
+};
+
+/* Size of the arena with what lies after it for an extent of that size */
+#ifdef SLAB
+#define ARENA_HEADER(extent) (sizeof(struct arena) + SLAB_PAGES(extent))
+#else
+#define ARENA_HEADER(extent) sizeof(struct arena)
+#endif
+
+#ifdef THREADS
+static struct arena *main_arena;     /* Arena 0, in the memlib heap */
+static __thread struct arena *arena; /* Arena locked by the thread */
+static unsigned heap_gen;            /* Incremented by every mm_init */
+static pthread_key_t tcache_key;     /* Flushes the tcache at thread exit */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread struct tcache tcache; /* In .tbss, outside of the heap */
+
+/* Blocks and arena left by a previous mm_init are forgotten. */
+static inline void tcache_check_gen(void) {
+  if (tcache.gen != heap_gen) {
+    memset(tcache.count, 0, sizeof(tcache.count));
+    memset(tcache.bins, 0, sizeof(tcache.bins));
+    tcache.arena = NULL;
+    tcache.gen = heap_gen;
+  }
+}
+#else
+static struct arena *arena; /* The only arena, in the memlib heap */
+#endif
+
+#ifdef PROFILE
+static struct profile *profile; /* Mapped by the first mm_profile_start */
+#ifdef THREADS
+static __thread struct sampler sampler;
+#else
+static struct sampler sampler;
+#endif
+#endif
 
 static size_t round_up(size_t size) {
   return (size + ALIGNMENT - 1) & -ALIGNMENT;
@@ -159,7 +799,7 @@ static inline word_t *bt_footer(word_t *bt) {
 /* Returns address of next block or NULL. */
 static inline word_t *bt_next(word_t *bt) {
   word_t *next = bt_footer(bt) + 1;
-  return (next == heap_epilogue) ? NULL : next;
+  return (next == arena->heap_epilogue) ? NULL : next;
 }
 
 /* Returns address of previous block or NULL. */
@@ -185,18 +825,141 @@ static inline void bt_make(word_t *bt, word_t words, bt_flags flags) {
   PUT(bt_footer(bt), PACK(words, flags));
 }
 
+/*
+ * Blocks carved out of the memory above arena->fresh get it moved past their
+ * end, the header and free list links of the block after them. Above that mark
+ * the heap reads as zeros except for the boundary tags and links of the free
+ * block lying there, so calloc doesn't have to clear it.
+ */
+static inline void bt_touch(word_t *bt) {
+  char *end = (char *)(bt + bt_size(bt) + 3);
+  if (end > arena->fresh)
+    arena->fresh = end;
+}
+
+/*
+ * arena_init - Sets up an empty heap with the epilogue at the given address.
+ */
+static void arena_init(struct arena *a, word_t *epilogue, char *limit) {
+#ifdef THREADS
+  pthread_mutex_init(&a->lock, NULL);
+  memset(a->arenas, 0, sizeof(a->arenas));
+  a->remote = -1;
+  a->locks = a->contended = a->remote_frees = 0;
+#endif
+
+  /* setting header in epilogue */
+  a->heap_start = a->heap_epilogue = epilogue;
+  PUT(a->heap_epilogue, USED);
+
+  a->last = NULL;
+  a->brk = (char *)(epilogue + 1);
+  a->limit = limit;
+  a->fresh = (char *)(epilogue + 1);
+  a->nursery = -1;
+
+  a->trim_threshold = TRIM_THRESHOLD;
+  a->trimmed = false;
+  a->huge = NULL;
+
+#ifdef TLSF
+  /* all lists are empty */
+  a->tlsf.fl_bitmap = 0;
+  for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+    a->tlsf.sl_bitmap[fl] = 0;
+    for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+      a->tlsf.heads[fl][sl] = -1;
+  }
+#else
+  /* setting buckets pointers */
+  for (int i = 0; i < N_BUCKETS; i++)
+    a->segregated_list[i] = a->heap_start - 1;
+#endif
+
+#ifdef FIT_INDEX
+  /* arrays start in the header */
+  for (int i = 0; i < N_BUCKETS - 1; i++) {
+    a->fit[i].sizes = a->fit[i].local;
+    a->fit[i].count = 0;
+    a->fit[i].capacity = FIT_LOCAL;
+  }
+#endif
+
+#ifdef FASTBINS
+  /* all bins are empty */
+  for (int i = 0; i < FASTBIN_COUNT; i++)
+    a->fastbins[i] = -1;
+  a->fastbin_bytes = 0;
+#endif
+
+#ifdef SLAB
+  /* no runs yet */
+  memset(a->slab_runs, 0, sizeof(a->slab_runs));
+  /* the bitmap lies in memory fresh from the system, it reads as zeros */
+  a->slab_pages = (uint8_t *)(a + 1);
+#endif
+
+#ifdef STATS
+  memset(&a->stats, 0, sizeof(a->stats));
+#endif
+}
+
+/*
+ * arena_sbrk - Moves the end of the current arena's heap like mem_sbrk does.
+ */
+static void *arena_sbrk(long incr) {
+#ifdef THREADS
+  if (arena != main_arena) {
+    char *old_brk = arena->brk;
+
+    if (old_brk + incr > arena->limit)
+      return (void *)-1;
+
+    arena->brk += incr;
+    if (incr < 0)
+      mem_release(arena->brk, -incr + mem_pagesize() - 1);
+    return old_brk;
+  }
+#endif
+  return mem_sbrk(incr);
+}
+
+#ifdef PROFILE
+#ifdef THREADS
+#define profile_lock(p) pthread_mutex_lock(&(p)->lock)
+#define profile_unlock(p) pthread_mutex_unlock(&(p)->lock)
+#else
+#define profile_lock(p)
+#define profile_unlock(p)
+#endif
+
+/* Samples of the old heap are forgotten by mm_init, sites are kept. */
+static void profile_reset(void) {
+  if (profile == NULL)
+    return;
+  profile_lock(profile);
+  profile->gen++;
+  profile->live = 0;
+  memset(profile->filter, 0, sizeof(profile->filter));
+  profile_unlock(profile);
+}
+#else
+#define profile_reset()
+#endif
+
 /*
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void) {
+  struct arena *a;
 
-  /* taking the place for pointers corresponding to buckets */
-  if ((segregated_list = mem_sbrk(N_BUCKETS * sizeof(heap_start))) == NULL)
+  /* taking the place for the arena */
+  if ((a = mem_sbrk(ARENA_HEADER(MAX_HEAP))) == (void *)-1)
     return -1;
 
   /* alignment */
   void *temp;
-  if ((temp = mem_sbrk(0)) == NULL)
+  if ((temp = mem_sbrk(0)) == (void *)-1)
     return -1;
   size_t remainder = (uintptr_t)temp % 16;
 
@@ -204,328 +967,2965 @@ int mm_init(void) {
   size_t size = (remainder > 12) ? 16 - remainder - 12 : 12 - remainder;
 
   /* alignment */
-  if (mem_sbrk(size) == NULL)
+  if (mem_sbrk(size) == (void *)-1)
     return -1;
 
   /* epilogue */
-  heap_start = heap_epilogue = (word_t *)mem_sbrk(WSIZE);
-
-  /* setting header in epilogue */
-  PUT(heap_epilogue, USED);
+  arena_init(a, mem_sbrk(WSIZE), (char *)mem_heap_lo() + MAX_HEAP);
+  arena = a;
 
-  last = NULL;
+#ifdef THREADS
+  main_arena = a->arenas[0] = a;
 
-  /* setting buckets pointers */
-  for (int i = 0; i < N_BUCKETS; i++)
-    segregated_list[i] = heap_start - 1;
+  /* caches of all threads are stale now, this one starts on arena 0 */
+  heap_gen++;
+  tcache_check_gen();
+  tcache.arena = a;
+#endif
 
+  profile_reset();
   return 0;
 }
 
+#ifndef DRIVER
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
 /*
- * free list API
+ * lib_init - Sets the heap up on the first call when the allocator is used as
+ * 	a library, there is no driver to call mem_init and mm_init then.
  */
-static inline int find_bucket(word_t words) {
-  size_t size = words * WSIZE;
-  size_t boundary = 16;
-  int index = 0;
-  do {
-    if (size <= boundary) {
-      assert(size <= boundary && size > (boundary >> 1) &&
-             "blok w zlym kubelku");
-      return index;
-    }
-    index++;
-    boundary <<= 1;
+static void lib_init(void) {
+  mem_init();
+  mm_init();
+}
 
-  } while (index < N_BUCKETS - 1);
-  return N_BUCKETS - 1;
+#define lazy_init() pthread_once(&init_once, lib_init)
+#else
+#define lazy_init()
+#endif
+
+/*
+ * Links between blocks are distances from heap_start. All blocks start a
+ * multiple of ALIGNMENT bytes apart, so the distances are kept in granules of
+ * that size and 32 bits reach 32GiB of heap. Anything before heap_start is -1.
+ */
+#define GRANULE (ALIGNMENT / WSIZE) /* Words in a granule */
+
+#if MAX_HEAP / ALIGNMENT > INT32_MAX
+#error "MAX_HEAP is too big for the links between blocks"
+#endif
+
+static inline word_t bt_offset(struct arena *a, word_t *bt) {
+  ptrdiff_t words = bt - a->heap_start;
+  return (words < 0) ? -1 : (word_t)(words / GRANULE);
 }
 
+static inline word_t *bt_at(struct arena *a, word_t offset) {
+  return a->heap_start + (ptrdiff_t)offset * GRANULE;
+}
+
+/*
+ * free list API
+ */
 static inline void set_free_list_prev(word_t *bt, word_t *free_prev) {
-  PUT(bt + 2, (word_t)(free_prev - heap_start));
+  PUT(bt + 2, bt_offset(arena, free_prev));
 }
 
 static inline void set_free_list_next(word_t *bt, word_t *free_next) {
-  PUT(bt + 1, (word_t)(free_next - heap_start));
+  PUT(bt + 1, bt_offset(arena, free_next));
 }
 
 static inline word_t *get_free_list_prev(word_t *bt) {
-  return (*(bt + 2) < 0) ? NULL : heap_start + *(bt + 2);
+  return (*(bt + 2) < 0) ? NULL : bt_at(arena, *(bt + 2));
 }
 
 static inline word_t *get_free_list_next(word_t *bt) {
-  return ((word_t) * (bt + 1) < 0) ? NULL : heap_start + *(bt + 1);
+  return (*(bt + 1) < 0) ? NULL : bt_at(arena, *(bt + 1));
 }
 
-static inline void free_list_append(word_t *bt) {
+/*
+ * Size classes of the buckets come from mm-classes.h made by sizeclass, the
+ * table maps a size in granules to its bucket, bigger blocks go to the top one.
+ */
+#if CLASS_COUNT != N_BUCKETS - 1
+#error "mm-classes.h has to have N_BUCKETS - 1 classes"
+#endif
+
+static const uint32_t class_limits[CLASS_COUNT] = CLASS_LIMITS;
+
+static inline int find_bucket(word_t words) {
+  size_t granules = (words + GRANULE - 1) / GRANULE;
+  int index = (granules <= CLASS_GRANULES) ? size_class[granules] : CLASS_COUNT;
+  assert((index == CLASS_COUNT || words * WSIZE <= class_limits[index]) &&
+         (index == 0 || words * WSIZE > class_limits[index - 1]) &&
+         "blok w zlym kubelku");
+  return index;
+}
 
+#ifdef STATS
+/* Counts the free block in or out of its size class. */
+static inline void stats_count(word_t *bt, long sign) {
   int index = find_bucket(bt_size(bt));
+  arena->stats.free_blocks[index] += sign;
+  arena->stats.free_bytes[index] += sign * (long)(bt_size(bt) * WSIZE);
+}
+#endif
+
+#ifdef TLSF
+/* Maps block size to first and second level index rounding it down. */
+static inline void tlsf_mapping(size_t size, int *fl, int *sl) {
+  if (size < TLSF_SMALL) {
+    *fl = 0;
+    *sl = size >> 4;
+  } else {
+    int log2 = 63 - __builtin_clzl(size);
+    *fl = log2 - TLSF_SMALL_LOG2 + 1;
+    *sl = (size >> (log2 - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+  }
+}
+
+static inline void free_list_append(word_t *bt) {
+  STAT(stats_count(bt, 1));
 
-  set_free_list_prev(bt, heap_start - 1);
-  set_free_list_next(bt, segregated_list[index]);
+  int fl, sl;
+  tlsf_mapping(bt_size(bt) * WSIZE, &fl, &sl);
 
-  segregated_list[index] = bt;
+  set_free_list_prev(bt, arena->heap_start - 1);
+  set_free_list_next(bt, bt_at(arena, arena->tlsf.heads[fl][sl]));
 
   if (get_free_list_next(bt))
     set_free_list_prev(get_free_list_next(bt), bt);
+
+  arena->tlsf.heads[fl][sl] = bt_offset(arena, bt);
+  arena->tlsf.fl_bitmap |= 1U << fl;
+  arena->tlsf.sl_bitmap[fl] |= 1U << sl;
 }
 
-// free block : [ headr | next | prev | ... | footer ]
 static inline void free_list_delete(word_t *bt) {
+  STAT(stats_count(bt, -1));
 
-  int index = find_bucket(bt_size(bt));
+  word_t *prev = get_free_list_prev(bt);
+  word_t *next = get_free_list_next(bt);
 
-  // block is the only one in the list
-  if (segregated_list[index] == bt && get_free_list_next(bt) == NULL) {
-    segregated_list[index] = heap_start - 1;
-  }
-  // block is the first one but not the last
-  else if (segregated_list[index] == bt) {
-    segregated_list[index] = get_free_list_next(bt);
-    set_free_list_prev(segregated_list[index], heap_start - 1);
-  }
-  // block is somewhere in the middle of the list
-  else if (get_free_list_next(bt) != NULL) {
-    set_free_list_next(get_free_list_prev(bt), get_free_list_next(bt));
-    set_free_list_prev(get_free_list_next(bt), get_free_list_prev(bt));
+  if (next)
+    set_free_list_prev(next, prev ? prev : arena->heap_start - 1);
+
+  if (prev) {
+    set_free_list_next(prev, next ? next : arena->heap_start - 1);
+    return;
   }
-  // block is the last one in the list
-  else {
-    set_free_list_next(get_free_list_prev(bt), heap_start - 1);
+
+  /* block is the first one in the list */
+  int fl, sl;
+  tlsf_mapping(bt_size(bt) * WSIZE, &fl, &sl);
+
+  if (next) {
+    arena->tlsf.heads[fl][sl] = bt_offset(arena, next);
+    return;
   }
-}
 
+  /* list becomes empty */
+  arena->tlsf.heads[fl][sl] = -1;
+  arena->tlsf.sl_bitmap[fl] &= ~(1U << sl);
+  if (arena->tlsf.sl_bitmap[fl] == 0)
+    arena->tlsf.fl_bitmap &= ~(1U << fl);
+}
+#else
 /*
- * coalesce - If possible, it combines adjacent free blocks into one
- * 	and adds it to the list of free blocks.
+ * Best fit tree of the top bucket. Blocks are ordered by size, then by
+ * address, and kept as a treap with a priority hashed from the address, so the
+ * tree stays balanced on average. Left and right children take the place of
+ * the next and prev links. The bucket pointer is the root.
  */
-static word_t *coalesce(word_t *bt) {
+#define TOP_BUCKET (N_BUCKETS - 1)
 
-  /* this is NULL if the previous block is used */
-  word_t *prev = bt_prev(bt);
-  /* this is NULL if the next block is epilogue */
-  word_t *next = bt_next(bt);
+static inline word_t *tree_child(word_t *bt, int side) {
+  return (*(bt + 1 + side) < 0) ? NULL : bt_at(arena, *(bt + 1 + side));
+}
 
-  int prev_used = (prev) ? bt_used(prev) : 1;
-  int next_used = (next) ? bt_used(next) : 1;
+static inline void tree_set_child(word_t *bt, int side, word_t *child) {
+  PUT(bt + 1 + side, (child) ? bt_offset(arena, child) : -1);
+}
 
-  word_t words = bt_size(bt);
+static inline uint32_t tree_priority(word_t *bt) {
+  return (uint32_t)bt_offset(arena, bt) * 2654435761U;
+}
+
+/* Returns 1 if b goes to the right of a. */
+static inline int tree_side(word_t *a, word_t *b) {
+  return bt_size(a) < bt_size(b) || (bt_size(a) == bt_size(b) && a < b);
+}
 
-  int is_change = (bt == last || (next == last && !next_used) ? 1 : 0);
+static inline word_t *tree_root(void) {
+  word_t *root = arena->segregated_list[TOP_BUCKET];
+  return (root == arena->heap_start - 1) ? NULL : root;
+}
 
-  if (!next_used) {
-    words += bt_size(next);
-    free_list_delete(next);
-  }
+static inline void tree_set_root(word_t *root) {
+  arena->segregated_list[TOP_BUCKET] = (root) ? root : arena->heap_start - 1;
+}
 
-  if (!prev_used) {
-    words += bt_size(prev);
-    free_list_delete(prev);
-    bt = prev;
+static word_t *tree_insert(word_t *root, word_t *bt) {
+  if (root == NULL) {
+    tree_set_child(bt, 0, NULL);
+    tree_set_child(bt, 1, NULL);
+    return bt;
   }
 
-  bt_make(bt, words, FREE);
-  free_list_append(bt);
-
-  last = (is_change) ? bt : last;
+  int side = tree_side(root, bt);
+  word_t *child = tree_insert(tree_child(root, side), bt);
+  tree_set_child(root, side, child);
 
-  return bt;
+  /* rotating the child up to keep the heap order of priorities */
+  if (tree_priority(child) > tree_priority(root)) {
+    tree_set_child(root, side, tree_child(child, !side));
+    tree_set_child(child, !side, root);
+    return child;
+  }
+  return root;
 }
 
-/*
- * extend_heap
- */
-static word_t *extend_heap(size_t size) {
-  word_t *bt;
-  bt_flags flags = 0;
-  if ((void *)mem_sbrk(size) == (void *)-1)
-    return NULL;
-
-  /* old epilogue becomes begining of the new block */
-  bt = heap_epilogue;
+static word_t *tree_merge(word_t *left, word_t *right) {
+  if (left == NULL)
+    return right;
+  if (right == NULL)
+    return left;
 
-  /* checking if old last block is free */
-  if (last && !(bt_used(last)))
-    flags |= PREVFREE;
-  flags |= FREE;
+  if (tree_priority(left) > tree_priority(right)) {
+    tree_set_child(left, 1, tree_merge(tree_child(left, 1), right));
+    return left;
+  }
+  tree_set_child(right, 0, tree_merge(left, tree_child(right, 0)));
+  return right;
+}
 
-  bt_make(bt, size / WSIZE, flags);
+static word_t *tree_delete(word_t *root, word_t *bt) {
+  if (root == bt)
+    return tree_merge(tree_child(bt, 0), tree_child(bt, 1));
 
-  last = bt;
+  int side = tree_side(root, bt);
+  tree_set_child(root, side, tree_delete(tree_child(root, side), bt));
+  return root;
+}
 
-  /* epilogue */
-  PUT(heap_epilogue = bt_footer(bt) + 1, PACK(0, USED));
-  assert((uintptr_t)heap_epilogue % 16 == 12 &&
-         "extend_heap niewyrownany epilogue");
+/* Returns the smallest block of at least the given size, the lowest one of
+ * the equal ones. */
+static word_t *tree_find(word_t words) {
+  word_t *fit = NULL;
 
-  /* coalescing with old last block in case it is free */
-  return coalesce(bt);
+  for (word_t *bt = tree_root(); bt != NULL;) {
+    STAT(arena->stats.probe++);
+    if (bt_size(bt) >= words) {
+      fit = bt;
+      bt = tree_child(bt, 0);
+    } else {
+      bt = tree_child(bt, 1);
+    }
+  }
+  return fit;
 }
 
-/*
- * place - Places metadata on the block, marks it as used and, if possible,
- * 	creates a new free block and adds it to the list of free blocks
- */
-static void place(void *bt, word_t words_needed) {
+#ifdef FIT_INDEX
+static inline word_t *fit_offsets(struct fit_bucket *b) {
+  return b->sizes + b->capacity;
+}
 
-  word_t free_block_words = bt_size(bt);
-  free_list_delete(bt);
+/* Doubles the arrays of the bucket, mapped ones are moved by mremap. */
+static bool fit_grow(struct fit_bucket *b) {
+  size_t old_bytes = (size_t)b->capacity * 2 * WSIZE;
+  size_t bytes = (old_bytes < mem_pagesize()) ? mem_pagesize() : 2 * old_bytes;
+  word_t *sizes;
 
-  /* setting the block to used and creating new free block grom the leftovers*/
-  if (free_block_words - words_needed >= ALIGNMENT) {
-    bt_make(bt, words_needed, USED | bt_get_prevfree(bt));
+  if (b->sizes == b->local) {
+    if ((sizes = mem_map(bytes, mem_pagesize())) != NULL)
+      memcpy(sizes, b->local, old_bytes);
+  } else {
+    sizes = mem_remap(b->sizes, old_bytes, bytes);
+  }
 
-    word_t *remaining_block = bt_next(bt);
-    bt_make(remaining_block, free_block_words - words_needed, FREE);
-    free_list_append(remaining_block);
+  if (sizes == NULL)
+    return false;
 
-    last = (last == bt) ? remaining_block : last;
+  /* offsets move to the middle of the bigger mapping */
+  word_t capacity = bytes / (2 * WSIZE);
+  memmove(sizes + capacity, sizes + b->capacity, b->count * WSIZE);
+  b->sizes = sizes;
+  b->capacity = capacity;
+  return true;
+}
 
-    /* setting the block to used */
-  } else {
-    bt_make(bt, free_block_words, USED);
+/* Returns the position of the last size of at least words or -1, the blocks
+ * added last are looked at first like in a LIFO list. */
+static inline int fit_scan(word_t *sizes, int count, word_t words) {
+  int i = count;
+
+#if defined(__AVX2__)
+  __m256i want = _mm256_set1_epi32(words - 1);
+  for (; i >= 8; i -= 8) {
+    __m256i v = _mm256_loadu_si256((__m256i *)(sizes + i - 8));
+    int mask =
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, want)));
+    if (mask)
+      return i - 8 + 31 - __builtin_clz(mask);
+  }
+#elif defined(__SSE2__)
+  __m128i want = _mm_set1_epi32(words - 1);
+  for (; i >= 4; i -= 4) {
+    __m128i v = _mm_loadu_si128((__m128i *)(sizes + i - 4));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, want)));
+    if (mask)
+      return i - 4 + 31 - __builtin_clz(mask);
   }
+#endif
+
+  while (i-- > 0)
+    if (sizes[i] >= words)
+      return i;
+  return -1;
 }
 
-/*
- * find_fit - Searches for a free block of the given size or larger using first
- * fit startegy. Searches bucket by bucket, increasing block sizes. Skips empty
- * buckets.
- */
+// free block : [ headr | position | ... | footer ]
+static inline void free_list_append(word_t *bt) {
+  STAT(stats_count(bt, 1));
+
+  int index = find_bucket(bt_size(bt));
+
+  if (index == TOP_BUCKET) {
+    tree_set_root(tree_insert(tree_root(), bt));
+    return;
+  }
+
+  /* a block that finds no room stays free, only malloc doesn't see it */
+  struct fit_bucket *b = &arena->fit[index];
+  if (b->count == b->capacity && !fit_grow(b)) {
+    PUT(bt + 1, -1);
+    return;
+  }
+
+  b->sizes[b->count] = bt_size(bt);
+  fit_offsets(b)[b->count] = bt_offset(arena, bt);
+  PUT(bt + 1, b->count++);
+}
+
+static inline void free_list_delete(word_t *bt) {
+  STAT(stats_count(bt, -1));
+
+  int index = find_bucket(bt_size(bt));
+
+  if (index == TOP_BUCKET) {
+    tree_set_root(tree_delete(tree_root(), bt));
+    return;
+  }
+
+  word_t i = *(bt + 1);
+  if (i < 0)
+    return;
+
+  /* the last block takes the place of the deleted one */
+  struct fit_bucket *b = &arena->fit[index];
+  word_t *offsets = fit_offsets(b);
+  assert(offsets[i] == bt_offset(arena, bt) && "blok spoza indeksu");
+
+  b->count--;
+  b->sizes[i] = b->sizes[b->count];
+  offsets[i] = offsets[b->count];
+  PUT(bt_at(arena, offsets[i]) + 1, i);
+}
+#else
+static inline void free_list_append(word_t *bt) {
+  STAT(stats_count(bt, 1));
+
+  int index = find_bucket(bt_size(bt));
+
+  if (index == TOP_BUCKET) {
+    tree_set_root(tree_insert(tree_root(), bt));
+    return;
+  }
+
+  set_free_list_prev(bt, arena->heap_start - 1);
+  set_free_list_next(bt, arena->segregated_list[index]);
+
+  arena->segregated_list[index] = bt;
+
+  if (get_free_list_next(bt))
+    set_free_list_prev(get_free_list_next(bt), bt);
+}
+
+// free block : [ headr | next | prev | ... | footer ]
+static inline void free_list_delete(word_t *bt) {
+  STAT(stats_count(bt, -1));
+
+  int index = find_bucket(bt_size(bt));
+
+  if (index == TOP_BUCKET) {
+    tree_set_root(tree_delete(tree_root(), bt));
+    return;
+  }
+
+  // block is the only one in the list
+  if (arena->segregated_list[index] == bt && get_free_list_next(bt) == NULL) {
+    arena->segregated_list[index] = arena->heap_start - 1;
+  }
+  // block is the first one but not the last
+  else if (arena->segregated_list[index] == bt) {
+    arena->segregated_list[index] = get_free_list_next(bt);
+    set_free_list_prev(arena->segregated_list[index], arena->heap_start - 1);
+  }
+  // block is somewhere in the middle of the list
+  else if (get_free_list_next(bt) != NULL) {
+    set_free_list_next(get_free_list_prev(bt), get_free_list_next(bt));
+    set_free_list_prev(get_free_list_next(bt), get_free_list_prev(bt));
+  }
+  // block is the last one in the list
+  else {
+    set_free_list_next(get_free_list_prev(bt), arena->heap_start - 1);
+  }
+}
+#endif /* !FIT_INDEX */
+#endif /* !TLSF */
+
+/*
+ * coalesce - If possible, it combines adjacent free blocks into one
+ * 	and adds it to the list of free blocks.
+ */
+static word_t *coalesce(word_t *bt) {
+
+  /* this is NULL if the previous block is used */
+  word_t *prev = bt_prev(bt);
+  /* this is NULL if the next block is epilogue */
+  word_t *next = bt_next(bt);
+
+  int prev_used = (prev) ? bt_used(prev) : 1;
+  int next_used = (next) ? bt_used(next) : 1;
+
+  word_t words = bt_size(bt);
+
+  /* blocks can't grow past the size the header holds */
+  if (!next_used && (size_t)words + bt_size(next) > BT_MAX)
+    next_used = 1;
+  if (!prev_used && (size_t)words + bt_size(prev) +
+                      ((next_used) ? 0 : bt_size(next)) > BT_MAX)
+    prev_used = 1;
+
+  int is_change =
+    (bt == arena->last || (next == arena->last && !next_used) ? 1 : 0);
+
+  if (!next_used) {
+    STAT(arena->stats.coalesces++);
+    words += bt_size(next);
+    free_list_delete(next);
+  }
+
+  if (!prev_used) {
+    STAT(arena->stats.coalesces++);
+    words += bt_size(prev);
+    free_list_delete(prev);
+    bt = prev;
+  }
+
+  bt_make(bt, words, FREE | ((prev) ? bt_get_prevfree(bt) : 0));
+  free_list_append(bt);
+
+  arena->last = (is_change) ? bt : arena->last;
+
+  return bt;
+}
+
+/*
+ * extend_heap
+ */
+static word_t *extend_heap(size_t size) {
+  word_t *bt;
+  bt_flags flags = 0;
+  size_t hugepage = mem_hugepagesize();
+
+  /* the break is moved to a huge page boundary if there is room for it */
+  if (hugepage) {
+    char *brk = (char *)(arena->heap_epilogue + 1);
+    char *end = (char *)(((uintptr_t)brk + size + hugepage - 1) & -hugepage);
+    if (end <= arena->limit)
+      size = end - brk;
+  }
+
+  if ((void *)arena_sbrk(size) == (void *)-1)
+    return NULL;
+
+  STAT(arena->stats.extends++);
+  STAT(arena->stats.extend_bytes += size);
+
+  /* heap grows back after trimming, trimming is too eager */
+  if (arena->trimmed) {
+    arena->trim_threshold *= 2;
+    arena->trimmed = false;
+  }
+
+  /* old epilogue becomes begining of the new block */
+  bt = arena->heap_epilogue;
+
+  /* checking if old last block is free */
+  if (arena->last && !(bt_used(arena->last)))
+    flags |= PREVFREE;
+  flags |= FREE;
+
+  bt_make(bt, size / WSIZE, flags);
+
+  arena->last = bt;
+
+  /* epilogue */
+  PUT(arena->heap_epilogue = bt_footer(bt) + 1, PACK(0, USED));
+  assert((uintptr_t)arena->heap_epilogue % 16 == 12 &&
+         "extend_heap niewyrownany epilogue");
+
+  /* coalescing with old last block in case it is free */
+  word_t *merged = coalesce(bt);
+
+  /* tags left inside the merged block have to read as zeros above fresh */
+  if (merged != bt) {
+    if ((char *)(bt - 1) >= arena->fresh)
+      PUT(bt - 1, 0);
+    if ((char *)bt >= arena->fresh)
+      PUT(bt, 0);
+  }
+
+  return merged;
+}
+
+/*
+ * trim_heap - Cuts the free last block down to pad bytes and moves the break
+ * 	down. At least the minimal block stays, the used block before it could not
+ * 	become the last one as it has no footer to be found by.
+ */
+static bool trim_heap(size_t pad) {
+
+  if (arena->last == NULL || bt_used(arena->last))
+    return false;
+
+  /* nothing to give back if pad covers the whole free tail */
+  word_t words = bt_size(arena->last);
+  if (pad >= (size_t)words * WSIZE)
+    return false;
+
+  word_t keep = round_up(pad) / WSIZE;
+  keep = (keep < MINBSIZE) ? MINBSIZE : keep;
+
+  if (words <= keep || (words - keep) * WSIZE < mem_pagesize())
+    return false;
+
+  free_list_delete(arena->last);
+
+  /* epilogue */
+  PUT(arena->heap_epilogue = arena->last + keep, PACK(0, USED));
+
+  bt_make(arena->last, keep, FREE | bt_get_prevfree(arena->last));
+  free_list_append(arena->last);
+
+  arena_sbrk(-(long)((words - keep) * WSIZE));
+
+  /* the pages above the break were given back and read as zeros again */
+  size_t pagesize = mem_pagesize();
+  char *top = (char *)(((uintptr_t)(arena->heap_epilogue + 1) + pagesize - 1) &
+                       -pagesize);
+  if (top < arena->fresh)
+    arena->fresh = top;
+
+  STAT(arena->stats.trims++);
+  return true;
+}
+
+/*
+ * place - Places metadata on the block, marks it as used and, if possible,
+ * 	creates a new free block and adds it to the list of free blocks
+ */
+static void place(void *bt, word_t words_needed) {
+
+  word_t free_block_words = bt_size(bt);
+  free_list_delete(bt);
+
+  /* setting the block to used and creating new free block grom the leftovers*/
+  if (free_block_words - words_needed >= ALIGNMENT) {
+    STAT(arena->stats.splits++);
+    bt_make(bt, words_needed, USED | bt_get_prevfree(bt));
+
+    word_t *remaining_block = bt_next(bt);
+    bt_make(remaining_block, free_block_words - words_needed, FREE);
+    free_list_append(remaining_block);
+
+    arena->last = (arena->last == bt) ? remaining_block : arena->last;
+
+    /* setting the block to used */
+  } else {
+    bt_make(bt, free_block_words, USED);
+  }
+
+  bt_touch(bt);
+}
+
+/*
+ * place_end - Cuts the used block from the end of the free block instead of
+ * 	its front, the front stays free. Returns the used block.
+ */
+static word_t *place_end(word_t *bt, word_t words_needed) {
+
+  word_t free_block_words = bt_size(bt);
+  if (free_block_words - words_needed < ALIGNMENT) {
+    place(bt, words_needed);
+    return bt;
+  }
+
+  STAT(arena->stats.splits++);
+  free_list_delete(bt);
+  bt_make(bt, free_block_words - words_needed, FREE | bt_get_prevfree(bt));
+  free_list_append(bt);
+
+  word_t *used = bt_next(bt);
+  bt_make(used, words_needed, USED | PREVFREE);
+
+  arena->last = (arena->last == bt) ? used : arena->last;
+
+  bt_touch(used);
+  return used;
+}
+
+/*
+ * place_batch - Cuts as many used blocks of the given size as fit, but no more
+ * 	than n, from the front of the free block in a single pass. The leftover
+ * 	becomes a free block like in place. Returns the number of blocks, their
+ * 	payloads are stored in out.
+ */
+static size_t place_batch(word_t *bt, word_t words, size_t n, void **out) {
+
+  word_t free_block_words = bt_size(bt);
+  size_t count = free_block_words / words;
+  count = (count < n) ? count : n;
+  free_list_delete(bt);
+
+  /* only the first block can have a free predecessor */
+  word_t *first = bt, *last = bt;
+  bt_flags flags = USED | bt_get_prevfree(bt);
+  for (size_t i = 0; i < count; i++) {
+    PUT(bt, PACK(words, flags));
+    out[i] = bt_payload(bt);
+    flags = USED;
+    last = bt;
+    bt += words;
+  }
+
+  word_t leftover = free_block_words - count * words;
+  if (leftover >= ALIGNMENT) {
+    STAT(arena->stats.splits++);
+    bt_make(bt, leftover, FREE);
+    free_list_append(bt);
+    arena->last = (arena->last == first) ? bt : arena->last;
+  } else {
+    /* the last block takes the leftover */
+    bt_make(last, words + leftover, USED | bt_get_prevfree(last));
+    arena->last = (arena->last == first) ? last : arena->last;
+  }
+
+  bt_touch(last);
+  return count;
+}
+
+/*
+ * shrink - Cuts used block down to the given size. If the leftover is big
+ * 	enough it becomes a free block and gets coalesced with its successor.
+ */
+static void shrink(word_t *bt, word_t words_needed) {
+
+  word_t leftover = bt_size(bt) - words_needed;
+  if (leftover < ALIGNMENT)
+    return;
+
+  STAT(arena->stats.splits++);
+  bt_make(bt, words_needed, USED | bt_get_prevfree(bt));
+
+  word_t *remaining_block = bt_next(bt);
+  bt_make(remaining_block, leftover, FREE);
+
+  arena->last = (arena->last == bt) ? remaining_block : arena->last;
+
+  coalesce(remaining_block);
+
+  /* giving the free tail back */
+  if (!bt_used(arena->last) &&
+      bt_size(arena->last) * WSIZE > arena->trim_threshold)
+    arena->trimmed |= trim_heap(0);
+}
+
+#ifdef TLSF
+/*
+ * find_fit - Rounds the size up to the next list boundary so that every block
+ * of the found list is big enough and picks the first non-empty list using
+ * the bitmaps. Only if there is no such list the exact list is searched first
+ * fit, which keeps the heap from growing when the block is already there.
+ */
+static word_t *find_fit(word_t words) {
+  size_t size = words * WSIZE;
+  int fl, sl;
+
+  if (size >= TLSF_SMALL)
+    size += (1UL << (63 - __builtin_clzl(size) - TLSF_SL_LOG2)) - 1;
+  tlsf_mapping(size, &fl, &sl);
+
+  uint32_t sl_map = arena->tlsf.sl_bitmap[fl] & (~0U << sl);
+  if (sl_map == 0) {
+    uint32_t fl_map = arena->tlsf.fl_bitmap & (~0U << fl << 1);
+    if (fl_map != 0) {
+      fl = __builtin_ctz(fl_map);
+      sl_map = arena->tlsf.sl_bitmap[fl];
+    }
+  }
+  if (sl_map != 0)
+    return bt_at(arena, arena->tlsf.heads[fl][__builtin_ctz(sl_map)]);
+
+  /* searching in the list the size belongs to */
+  tlsf_mapping(words * WSIZE, &fl, &sl);
+  if (arena->tlsf.heads[fl][sl] < 0)
+    return NULL;
+
+  for (word_t *bt = bt_at(arena, arena->tlsf.heads[fl][sl]); bt != NULL;
+       bt = get_free_list_next(bt)) {
+    STAT(arena->stats.probe++);
+    if (bt_size(bt) >= words)
+      return bt;
+  }
+
+  return NULL;
+}
+#elif defined(FIT_INDEX)
+/*
+ * find_fit - Scans the sizes in the bucket of the request for a block big
+ * 	enough, the newest first. Every block in the buckets above fits, so the
+ * 	one added last is taken from the first of them that isn't empty.
+ */
+static word_t *find_fit(word_t words) {
+  int index = find_bucket(words);
+
+  if (index < TOP_BUCKET) {
+    struct fit_bucket *b = &arena->fit[index];
+    int i = fit_scan(b->sizes, b->count, words);
+    STAT(arena->stats.probe += b->count - ((i >= 0) ? i : 0));
+    if (i >= 0)
+      return bt_at(arena, fit_offsets(b)[i]);
+
+    while (++index < TOP_BUCKET) {
+      b = &arena->fit[index];
+      if (b->count)
+        return bt_at(arena, fit_offsets(b)[b->count - 1]);
+    }
+  }
+
+  return tree_find(words);
+}
+#else
+/*
+ * find_fit - Searches for a free block of the given size or larger using first
+ * fit startegy. Searches bucket by bucket, increasing block sizes. Skips empty
+ * buckets. The top bucket tree gives the best fit.
+ */
 static word_t *find_fit(word_t words) {
   int index = find_bucket(words);
   word_t *bt;
-  do {
-    /* skips empty buckets */
-    while ((segregated_list[index] - heap_start == -1) && (index < N_BUCKETS))
-      index++;
+  do {
+    /* skips empty buckets */
+    while ((index < N_BUCKETS) &&
+           (arena->segregated_list[index] - arena->heap_start == -1))
+      index++;
+
+    if (index == N_BUCKETS)
+      return NULL;
+
+    /* the biggest blocks are searched best fit */
+    if (index == TOP_BUCKET)
+      return tree_find(words);
+
+    bt = arena->segregated_list[index];
+
+    /* searching in the selected bucket */
+    while (bt != NULL) {
+      STAT(arena->stats.probe++);
+      if (bt_size(bt) >= words)
+        return bt;
+
+      bt = get_free_list_next(bt);
+    }
+    index++;
+
+  } while (index < N_BUCKETS);
+  return NULL;
+}
+#endif /* !TLSF */
+
+#ifdef STATS
+/* find_fit that counts the call in the histogram of blocks looked at. */
+static word_t *search_fit(word_t words) {
+  arena->stats.probe = 0;
+  word_t *bt = find_fit(words);
+
+  size_t probe = arena->stats.probe;
+  int index = (probe) ? 64 - __builtin_clzl(probe) : 0;
+  index = (index < MM_STATS_PROBES) ? index : MM_STATS_PROBES - 1;
+  arena->stats.probes[index]++;
+  return bt;
+}
+#else
+#define search_fit(words) find_fit(words)
+#endif
+
+/*
+ * The blocks hinted as short-lived are cut from the end of the free block
+ * below the lowest of them, arena->nursery. It's the offset of a used block,
+ * the one after the free block that swallowed it, or -1.
+ */
+static inline word_t *nursery_get(void) {
+  return (arena->nursery < 0) ? NULL : bt_at(arena, arena->nursery);
+}
+
+static inline void nursery_freed(word_t *bt) {
+  word_t *nursery = nursery_get();
+  if (nursery == NULL || nursery < bt || nursery >= bt + bt_size(bt))
+    return;
+
+  nursery = bt_next(bt);
+  while (nursery != NULL && !bt_used(nursery))
+    nursery = bt_next(nursery);
+  arena->nursery = (nursery) ? bt_offset(arena, nursery) : -1;
+}
+
+/*
+ * free_block - Marks the block as free, coalesces it with free neighbors and
+ * 	gives the free tail of the heap back if it grew too big.
+ */
+static void free_block(word_t *bt) {
+
+  bt_flags flags = FREE | bt_get_prevfree(bt);
+
+  bt_make(bt, bt_size(bt), flags);
+
+  /* coalescing free neighbors */
+  if (bt_get_prevfree(bt) || (bt_next(bt) && bt_used(bt_next(bt))))
+    bt = coalesce(bt);
+  else
+    free_list_append(bt);
+  nursery_freed(bt);
+
+  /* giving the free tail back */
+  if (!bt_used(arena->last) &&
+      bt_size(arena->last) * WSIZE > arena->trim_threshold)
+    arena->trimmed |= trim_heap(0);
+}
+
+#ifdef FASTBINS
+/* fast bins: deferred coalescing of small blocks */
+static inline int fastbin_index(word_t words) {
+  return words / MINBSIZE - 1;
+}
+
+static inline word_t *fastbin_get(word_t words) {
+  int index = fastbin_index(words);
+
+  if (index >= FASTBIN_COUNT || arena->fastbins[index] < 0)
+    return NULL;
+
+  word_t *bt = bt_at(arena, arena->fastbins[index]);
+  arena->fastbins[index] = *(bt + 1);
+  arena->fastbin_bytes -= words * WSIZE;
+  return bt;
+}
+
+static inline bool fastbin_put(word_t *bt) {
+  int index = fastbin_index(bt_size(bt));
+
+  if (index >= FASTBIN_COUNT)
+    return false;
+
+  PUT(bt + 1, arena->fastbins[index]);
+  arena->fastbins[index] = bt_offset(arena, bt);
+  arena->fastbin_bytes += bt_size(bt) * WSIZE;
+  return true;
+}
+
+/* Frees all blocks kept in the bins. Returns false if the bins were empty. */
+static bool fastbin_consolidate(void) {
+  if (arena->fastbin_bytes == 0)
+    return false;
+
+  for (int i = 0; i < FASTBIN_COUNT; i++) {
+    word_t head = arena->fastbins[i];
+    while (head >= 0) {
+      word_t *bt = bt_at(arena, head);
+      head = *(bt + 1);
+      free_block(bt);
+    }
+    arena->fastbins[i] = -1;
+  }
+  arena->fastbin_bytes = 0;
+  return true;
+}
+#else
+#define fastbin_get(words) NULL
+#define fastbin_put(bt) false
+#define fastbin_consolidate() false
+#endif /* !FASTBINS */
+
+/*
+ * heap_malloc - Searches the free lists for a fit and extends the heap if there
+ * 	is none. Returns the placed block or NULL if the heap is out of memory.
+ */
+static word_t *heap_malloc(word_t words) {
+  word_t *bt;
+
+  /* a block of the exact size sits in its fast bin */
+  if ((bt = fastbin_get(words)) != NULL)
+    return bt;
+
+  /* Search the free list for a fit, merging the fast bins on a miss */
+  if ((bt = search_fit(words)) != NULL ||
+      (fastbin_consolidate() && (bt = search_fit(words)) != NULL)) {
+    place(bt, words);
+    return bt;
+  }
+
+  // size (bytes) needed to extend_heap
+  size_t needed = words * WSIZE;
+
+  if (arena->last != NULL && !bt_used(arena->last))
+    needed -= bt_size(arena->last) * WSIZE;
+
+  if ((bt = extend_heap(needed)) == NULL)
+    return NULL;
+
+  place(bt, words);
+
+  return bt;
+}
+
+/*
+ * heap_zalloc - Allocates the block like heap_malloc and clears the first bytes
+ * 	of its payload. Only the part below the fresh mark, the free list links
+ * 	and the footer of the free block it came from are cleared, the rest of
+ * 	the memory has never been handed out.
+ */
+static word_t *heap_zalloc(word_t words, size_t bytes) {
+  char *fresh = arena->fresh;
+  word_t *bt = heap_malloc(words);
+
+  if (bt == NULL || bytes == 0)
+    return bt;
+
+  char *payload = bt_payload(bt);
+  char *end = payload + bytes;
+
+  if (fresh >= end) {
+    memset(payload, 0, bytes);
+    return bt;
+  }
+
+  if (fresh > payload)
+    memset(payload, 0, fresh - payload);
+  PUT(bt + 1, 0);
+  PUT(bt + 2, 0);
+  PUT(bt_footer(bt), 0);
+  return bt;
+}
+
+/*
+ * heap_free - Puts a small block into its fast bin, other blocks are freed
+ * 	right away.
+ */
+static void heap_free(word_t *bt) {
+  if (!fastbin_put(bt)) {
+    free_block(bt);
+    return;
+  }
+
+#ifdef FASTBINS
+  if (arena->fastbin_bytes > FASTBIN_THRESHOLD)
+    fastbin_consolidate();
+#endif
+}
+
+/* Returns the free block the short-lived blocks are cut from, if any. */
+static inline word_t *nursery_gap(void) {
+  word_t *nursery = nursery_get();
+  if (nursery != NULL)
+    return bt_prev(nursery);
+  return (arena->last != NULL && !bt_used(arena->last)) ? arena->last : NULL;
+}
+
+/*
+ * heap_malloc_short - Cuts the block from the end of the free block below the
+ * 	short-lived ones, so they stay together at the top of the heap and go
+ * 	back to that free block when they die. If it's too small a hole among
+ * 	them is taken first fit, otherwise the heap is extended, leaving the holes
+ * 	among the long-lived blocks to them.
+ */
+static word_t *heap_malloc_short(word_t words) {
+  word_t *nursery = nursery_get();
+  word_t *bt = nursery_gap();
+
+  if (bt == NULL || bt_size(bt) < words) {
+    bt = search_fit(words);
+    if (bt != NULL && nursery != NULL && bt > nursery) {
+      place(bt, words);
+      return bt;
+    }
+
+    /* the last block may be a hole among them too, missed by search_fit */
+    bt = arena->last;
+    if (bt == NULL || bt_used(bt) || bt_size(bt) < words) {
+      size_t needed = words * WSIZE;
+      if (bt != NULL && !bt_used(bt))
+        needed -= bt_size(bt) * WSIZE;
+      if ((bt = extend_heap(needed)) == NULL)
+        return NULL;
+    }
+
+    /* the lowest one stays the same */
+    if (nursery != NULL)
+      return place_end(bt, words);
+  }
+
+  bt = place_end(bt, words);
+  arena->nursery = bt_offset(arena, bt);
+  return bt;
+}
+
+/*
+ * heap_malloc_long - Allocates the block first fit like heap_malloc, but
+ * 	takes the front of the free block below the short-lived ones rather than
+ * 	a hole among them, where it would stay after they are gone.
+ */
+static word_t *heap_malloc_long(word_t words) {
+  word_t *bt = search_fit(words);
+
+  if (bt == NULL)
+    return heap_malloc(words);
+
+  word_t *nursery = nursery_get();
+  if (nursery != NULL && bt > nursery) {
+    word_t *gap = nursery_gap();
+    bt = (gap != NULL && bt_size(gap) >= words) ? gap : bt;
+  }
+
+  place(bt, words);
+  return bt;
+}
+
+/*
+ * heap_malloc_near - Puts the block right after the used one if the free
+ * 	block there is big enough, otherwise right before it, cut from the end of
+ * 	the free block there. If neither fits it's allocated as long-lived.
+ */
+static word_t *heap_malloc_near(word_t words, word_t *near) {
+  word_t *next = bt_next(near);
+  if (next != NULL && !bt_used(next) && bt_size(next) >= words) {
+    place(next, words);
+    return next;
+  }
+
+  word_t *prev = bt_prev(near);
+  if (prev != NULL && bt_size(prev) >= words)
+    return place_end(prev, words);
+
+  return heap_malloc_long(words);
+}
+
+/* Allocates the block where the hint of mm_malloc_hint asks for. */
+static word_t *heap_malloc_hint(word_t words, const void *hint) {
+  if (hint == MM_HINT_SHORT)
+    return heap_malloc_short(words);
+  if (hint == MM_HINT_LONG)
+    return heap_malloc_long(words);
+  return heap_malloc_near(words, (word_t *)hint - 1);
+}
+
+/*
+ * heap_malloc_batch - Allocates up to n blocks of the same size. Each free
+ * 	block found first fit gets cut into as many of them as it holds and
+ * 	whatever is missing comes from one extension of the heap, split at most
+ * 	into huge block sized parts. Looking for a single block that holds the
+ * 	whole batch would be fewer searches, but it cuts up the big blocks.
+ * 	Returns the number of blocks allocated.
+ */
+static size_t heap_malloc_batch(word_t words, size_t n, void **out) {
+  size_t count = 0;
+  word_t *bt;
+
+  /* blocks of the exact size sit in their fast bin */
+  while (count < n && (bt = fastbin_get(words)) != NULL)
+    out[count++] = bt_payload(bt);
+
+  while (count < n) {
+    size_t batch = HUGE_THRESHOLD / (words * WSIZE);
+    batch = (batch < 1) ? 1 : (batch < n - count) ? batch : n - count;
+
+    /* as much of the batch as the first fit takes */
+    if ((bt = search_fit(words)) == NULL &&
+        (!fastbin_consolidate() || (bt = search_fit(words)) == NULL)) {
+      size_t needed = batch * words * WSIZE;
+
+      if (arena->last != NULL && !bt_used(arena->last))
+        needed -= bt_size(arena->last) * WSIZE;
+
+      if ((bt = extend_heap(needed)) == NULL)
+        break;
+    }
+
+    count += place_batch(bt, words, batch, out + count);
+  }
+
+  return count;
+}
+
+/*
+ * heap_free_batch - Frees the blocks sorted by address. Blocks lying next to
+ * 	each other are joined into one block first, so each run of them is
+ * 	coalesced with its neighbors and put on the free list once. Fast bins
+ * 	are skipped and the free tail is given back after the whole sweep.
+ */
+static void heap_free_batch(void **ptrs, size_t n) {
+
+  for (size_t i = 0; i < n;) {
+    word_t *bt = (word_t *)ptrs[i] - 1, *end = bt;
+    word_t words = bt_size(bt);
+
+    while (++i < n && (word_t *)ptrs[i] - 1 == bt + words) {
+      end = (word_t *)ptrs[i] - 1;
+      words += bt_size(end);
+    }
+
+    arena->last = (arena->last == end) ? bt : arena->last;
+    PUT(bt, PACK(words, USED | bt_get_prevfree(bt)));
+    bt_make(bt, words, FREE | bt_get_prevfree(bt));
+    nursery_freed(coalesce(bt));
+  }
+
+  /* giving the free tail back */
+  if (!bt_used(arena->last) &&
+      bt_size(arena->last) * WSIZE > arena->trim_threshold)
+    arena->trimmed |= trim_heap(0);
+}
+
+/*
+ * heap_resize - Changes the size of the used block without moving it, i.e.
+ * 	when shrinking, when the next block is free and big enough or when the
+ * 	block is the last one and the heap can be extended. Returns false if the
+ * 	block has to be moved, always when it would grow to a huge size.
+ */
+static bool heap_resize(word_t *bt, word_t words) {
+  assert(words > 0 && "rozmiar bloku poza zakresem");
+
+  /* shrinking in place */
+  if (words <= bt_size(bt)) {
+    shrink(bt, words);
+    return true;
+  }
+
+  /* huge sizes get mappings of their own, the heap isn't extended for them */
+  if ((size_t)words * WSIZE >= HUGE_THRESHOLD)
+    return false;
+
+  word_t *next = bt_next(bt);
+
+  /* the last block can grow by extending the heap */
+  if (bt == arena->last || (next == arena->last && !bt_used(next))) {
+    word_t available = bt_size(bt) + ((next) ? bt_size(next) : 0);
+    if (available < words && !extend_heap((words - available) * WSIZE))
+      return false;
+    next = bt_next(bt);
+  }
+
+  /* growing in place by absorbing the free successor */
+  if (next && !bt_used(next) && bt_size(bt) + bt_size(next) >= words) {
+    free_list_delete(next);
+    arena->last = (arena->last == next) ? bt : arena->last;
+    bt_make(bt, bt_size(bt) + bt_size(next), USED | bt_get_prevfree(bt));
+    shrink(bt, words);
+    bt_touch(bt);
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * heap_trim - Cuts the free tail of the current arena down to pad bytes and
+ * 	releases the pages inside its other big free blocks.
+ */
+static bool heap_trim(size_t pad) {
+  fastbin_consolidate();
+
+  bool released = trim_heap(pad);
+  size_t pagesize = mem_pagesize();
+
+  for (word_t *bt = arena->heap_start; arena->last != NULL && bt != NULL;
+       bt = bt_next(bt)) {
+    if (bt_used(bt) || bt_size(bt) * WSIZE < 2 * pagesize)
+      continue;
+
+    /* header, next and prev at the beginning, footer at the end */
+    mem_release(bt + 3, (bt_size(bt) - 4) * WSIZE);
+    released = true;
+  }
+
+  return released;
+}
+
+/* Returns where the block would start with the payload aligned to align. */
+static inline word_t *bt_align(word_t *bt, size_t align) {
+  uintptr_t payload = (uintptr_t)bt_payload(bt);
+  return (word_t *)((payload + align - 1) & -align) - 1;
+}
+
+/*
+ * heap_malloc_aligned - Allocates a block with the payload aligned to align
+ * 	bytes (a power of two). The first fit for the size is taken if the
+ * 	aligned payload fits in it, otherwise a block with enough slack to move
+ * 	the payload forward. What's left in front becomes a free block and the
+ * 	tail is cut off.
+ */
+static word_t *heap_malloc_aligned(word_t words, size_t align) {
+  word_t *bt = search_fit(words);
+
+  if (bt != NULL && bt_align(bt, align) + words <= bt + bt_size(bt))
+    place(bt, bt_size(bt));
+  else if ((bt = heap_malloc(words + (align - ALIGNMENT) / WSIZE)) == NULL)
+    return NULL;
+
+  word_t *aligned = bt_align(bt, align);
+
+  /* the front is at least ALIGNMENT bytes long, so it makes a free block */
+  word_t front = aligned - bt;
+  if (front > 0) {
+    STAT(arena->stats.splits++);
+    bt_make(aligned, bt_size(bt) - front, USED);
+    arena->last = (arena->last == bt) ? aligned : arena->last;
+    PUT(bt, PACK(front, USED | bt_get_prevfree(bt)));
+    free_block(bt);
+  }
+
+  shrink(aligned, words);
+  return aligned;
+}
+
+#ifdef SLAB
+
+/* slab allocator */
+static inline bool slab_owns(struct arena *a, void *ptr) {
+  size_t page = ((char *)ptr - (char *)a) / SLAB_RUN;
+  return a->slab_pages[page / 8] & (1 << (page % 8));
+}
+
+static inline void slab_mark(struct slab_run *run, bool taken) {
+  size_t page = ((char *)run - (char *)arena) / SLAB_RUN;
+  if (taken)
+    arena->slab_pages[page / 8] |= 1 << (page % 8);
+  else
+    arena->slab_pages[page / 8] &= ~(1 << (page % 8));
+}
+
+static inline void slab_list_push(struct slab_run *run, int class) {
+  run->prev = NULL;
+  run->next = arena->slab_runs[class];
+  if (run->next)
+    run->next->prev = run;
+  arena->slab_runs[class] = run;
+}
+
+static inline void slab_list_delete(struct slab_run *run, int class) {
+  if (run->next)
+    run->next->prev = run->prev;
+  if (run->prev)
+    run->prev->next = run->next;
+  else
+    arena->slab_runs[class] = run->next;
+}
+
+/* Takes a page from the heap and makes it a run of empty slots. */
+static struct slab_run *slab_run_new(int class) {
+  word_t words = round_up(WSIZE + SLAB_RUN) / WSIZE;
+  word_t *bt = heap_malloc_aligned(words, SLAB_RUN);
+  if (bt == NULL)
+    return NULL;
+
+  struct slab_run *run = bt_payload(bt);
+  run->slot = (class + 1) * ALIGNMENT;
+  run->nslots = run->nfree = (SLAB_RUN - SLAB_HEADER) / run->slot;
+
+  memset(run->bitmap, 0, sizeof(run->bitmap));
+  for (int i = 0; i < run->nslots; i++)
+    run->bitmap[i / 64] |= 1UL << (i % 64);
+
+  slab_mark(run, true);
+  slab_list_push(run, class);
+  return run;
+}
+
+/*
+ * slab_malloc - Takes the first free slot of the first run of the class,
+ * 	a new run is made when there is none. Returns NULL if the heap is full.
+ */
+static void *slab_malloc(size_t size) {
+  int class = (size - 1) / ALIGNMENT;
+  struct slab_run *run = arena->slab_runs[class];
+
+  if (run == NULL && (run = slab_run_new(class)) == NULL)
+    return NULL;
+
+  int i = 0;
+  while (run->bitmap[i] == 0)
+    i++;
+  int slot = i * 64 + __builtin_ctzl(run->bitmap[i]);
+  run->bitmap[i] &= run->bitmap[i] - 1;
+
+  /* full runs leave the list */
+  if (--run->nfree == 0)
+    slab_list_delete(run, class);
+
+  return (char *)run + SLAB_HEADER + slot * run->slot;
+}
+
+/*
+ * slab_free - Marks the slot as free. A run that becomes empty goes back to
+ * 	the heap unless it's the last run of its class with free slots.
+ */
+static void slab_free(void *ptr) {
+  struct slab_run *run = (struct slab_run *)((uintptr_t)ptr & -SLAB_RUN);
+  int class = run->slot / ALIGNMENT - 1;
+  int slot = ((char *)ptr - (char *)run - SLAB_HEADER) / run->slot;
+
+  run->bitmap[slot / 64] |= 1UL << (slot % 64);
+
+  if (run->nfree++ == 0) {
+    slab_list_push(run, class);
+    return;
+  }
+
+  if (run->nfree == run->nslots && (run->next || run->prev)) {
+    slab_list_delete(run, class);
+    slab_mark(run, false);
+    heap_free((word_t *)run - 1);
+  }
+}
+
+/* Returns the size of the slot. */
+static inline size_t slab_size(void *ptr) {
+  return ((struct slab_run *)((uintptr_t)ptr & -SLAB_RUN))->slot;
+}
+#endif /* !SLAB */
+
+#ifdef THREADS
+/* thread-safe mode: arenas and thread cache */
+static inline void arena_lock(struct arena *a) {
+  if (pthread_mutex_trylock(&a->lock) != 0) {
+    __atomic_fetch_add(&a->contended, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&a->lock);
+  }
+  a->locks++;
+  arena = a;
+}
+
+static inline void arena_unlock(void) {
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/* Returns the arena the block belongs to. */
+static inline struct arena *arena_of(word_t *bt) {
+  if ((char *)bt > (char *)main_arena && (char *)bt < main_arena->limit)
+    return main_arena;
+  return (struct arena *)((uintptr_t)bt & -ARENA_SIZE);
+}
+
+/* Returns arena of given index, mapping it if it doesn't exist yet. */
+static struct arena *arena_get(int index) {
+  struct arena *a =
+    __atomic_load_n(&main_arena->arenas[index], __ATOMIC_ACQUIRE);
+  if (a != NULL)
+    return a;
+
+  char *base = mem_map(ARENA_SIZE, ARENA_SIZE);
+  if (base == NULL)
+    return main_arena;
+
+  /* epilogue at the first address after the structure that keeps alignment */
+  a = (struct arena *)base;
+  arena_init(a,
+             (word_t *)(base + round_up(ARENA_HEADER(ARENA_SIZE) + WSIZE) -
+                        WSIZE),
+             base + ARENA_SIZE);
+
+  /* another thread could have been faster */
+  struct arena *other = NULL;
+  if (!__atomic_compare_exchange_n(&main_arena->arenas[index], &other, a, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    mem_unmap(base, ARENA_SIZE);
+    return other;
+  }
+  return a;
+}
+
+/* Locks the arena of the calling thread, which is picked again by the CPU
+ * number if the lock is contended. */
+static void arena_lock_thread(void) {
+  tcache_check_gen();
+  struct arena *a = tcache.arena;
+
+  if (a != NULL) {
+    if (pthread_mutex_trylock(&a->lock) == 0) {
+      a->locks++;
+      arena = a;
+      return;
+    }
+    __atomic_fetch_add(&a->contended, 1, __ATOMIC_RELAXED);
+  }
+
+  int cpu = sched_getcpu();
+  a = arena_get((cpu < 0) ? 0 : cpu % N_ARENAS);
+  arena_lock(a);
+  tcache.arena = a;
+}
+
+/* Pushes the block onto the stack of remote frees of its arena. */
+static inline void arena_push_remote(struct arena *a, word_t *bt) {
+  word_t head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+  do {
+    PUT(bt + 1, head);
+  } while (!__atomic_compare_exchange_n(&a->remote, &head,
+                                        bt_offset(a, bt), true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees all blocks pushed by other threads, the arena must be locked. */
+static void arena_drain_remote(void) {
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) < 0)
+    return;
+
+  word_t head = __atomic_exchange_n(&arena->remote, -1, __ATOMIC_ACQUIRE);
+  while (head >= 0) {
+    word_t *bt = bt_at(arena, head);
+    head = *(bt + 1);
+    arena->remote_frees++;
+#ifdef SLAB
+    if (slab_owns(arena, bt_payload(bt))) {
+      slab_free(bt_payload(bt));
+      continue;
+    }
+#endif
+    heap_free(bt);
+  }
+}
+
+/* Allocates the block clearing the first zero bytes of its payload. */
+static word_t *arena_malloc(word_t words, size_t zero) {
+  struct arena *a;
+  word_t *bt;
+
+  arena_lock_thread();
+  a = arena;
+  arena_drain_remote();
+  bt = heap_zalloc(words, zero);
+  arena_unlock();
+
+  /* mapped arena is full, falling back on the memlib heap */
+  if (bt == NULL && a != main_arena) {
+    arena_lock(main_arena);
+    arena_drain_remote();
+    bt = heap_zalloc(words, zero);
+    arena_unlock();
+  }
+
+  return bt;
+}
+
+static word_t *arena_malloc_aligned(word_t words, size_t align) {
+  struct arena *a;
+  word_t *bt;
+
+  arena_lock_thread();
+  a = arena;
+  arena_drain_remote();
+  bt = heap_malloc_aligned(words, align);
+  arena_unlock();
+
+  /* mapped arena is full, falling back on the memlib heap */
+  if (bt == NULL && a != main_arena) {
+    arena_lock(main_arena);
+    arena_drain_remote();
+    bt = heap_malloc_aligned(words, align);
+    arena_unlock();
+  }
+
+  return bt;
+}
+
+/* Allocates the block with the hint in the arena of the thread, or in the
+ * arena of the block it has to be put next to. */
+static word_t *arena_malloc_hint(word_t words, const void *hint) {
+  struct arena *a;
+  word_t *bt;
+
+  if (hint == MM_HINT_SHORT || hint == MM_HINT_LONG)
+    arena_lock_thread();
+  else
+    arena_lock(arena_of((word_t *)hint - 1));
+  a = arena;
+  arena_drain_remote();
+  bt = heap_malloc_hint(words, hint);
+  arena_unlock();
+
+  /* mapped arena is full, falling back on the memlib heap without the hint */
+  if (bt == NULL && a != main_arena) {
+    arena_lock(main_arena);
+    arena_drain_remote();
+    bt = heap_malloc(words);
+    arena_unlock();
+  }
+
+  return bt;
+}
+
+static void arena_free(word_t *bt) {
+  struct arena *a = arena_of(bt);
+
+  /* the block belongs to an arena of another thread */
+  tcache_check_gen();
+  if (a != tcache.arena) {
+    arena_push_remote(a, bt);
+    return;
+  }
+
+  arena_lock(a);
+  heap_free(bt);
+  arena_unlock();
+}
+
+static size_t arena_malloc_batch(word_t words, size_t n, void **out) {
+  struct arena *a;
+  size_t count;
+
+  arena_lock_thread();
+  a = arena;
+  arena_drain_remote();
+  count = heap_malloc_batch(words, n, out);
+  arena_unlock();
+
+  /* mapped arena is full, falling back on the memlib heap */
+  if (count < n && a != main_arena) {
+    arena_lock(main_arena);
+    arena_drain_remote();
+    count += heap_malloc_batch(words, n - count, out + count);
+    arena_unlock();
+  }
+
+  return count;
+}
+
+/* Frees the blocks sorted by address, all from one arena. */
+static void arena_free_batch(void **ptrs, size_t n) {
+  struct arena *a = arena_of((word_t *)ptrs[0] - 1);
+
+  /* the blocks belong to an arena of another thread */
+  tcache_check_gen();
+  if (a != tcache.arena) {
+    for (size_t i = 0; i < n; i++)
+      arena_push_remote(a, (word_t *)ptrs[i] - 1);
+    return;
+  }
+
+  arena_lock(a);
+  heap_free_batch(ptrs, n);
+  arena_unlock();
+}
+
+static bool arena_resize(word_t *bt, word_t words) {
+  arena_lock(arena_of(bt));
+  bool resized = heap_resize(bt, words);
+  arena_unlock();
+  return resized;
+}
+
+static bool arena_trim(size_t pad) {
+  bool released = false;
+
+  for (int i = 0; i < N_ARENAS; i++) {
+    struct arena *a =
+      __atomic_load_n(&main_arena->arenas[i], __ATOMIC_ACQUIRE);
+    if (a != NULL) {
+      arena_lock(a);
+      arena_drain_remote();
+      released |= heap_trim(pad);
+      arena_unlock();
+    }
+  }
+
+  return released;
+}
+
+#ifdef SLAB
+static void *arena_slab_malloc(size_t size) {
+  arena_lock_thread();
+  arena_drain_remote();
+  void *ptr = slab_malloc(size);
+  arena_unlock();
+  return ptr;
+}
+
+static void arena_slab_free(void *ptr) {
+  struct arena *a = arena_of(ptr);
+
+  /* the slot belongs to an arena of another thread */
+  tcache_check_gen();
+  if (a != tcache.arena) {
+    arena_push_remote(a, (word_t *)ptr - 1);
+    return;
+  }
+
+  arena_lock(a);
+  slab_free(ptr);
+  arena_unlock();
+}
+#endif
+
+/* Gives all cached blocks back to their arenas. */
+static void tcache_flush(void *arg) {
+  struct tcache *tc = arg;
+
+  if (tc->gen != heap_gen)
+    return;
+
+  for (int i = 0; i < TCACHE_BINS; i++) {
+    while (tc->bins[i] != NULL) {
+      void *ptr = tc->bins[i];
+      tc->bins[i] = *(void **)ptr;
+      arena_free((word_t *)ptr - 1);
+    }
+    tc->count[i] = 0;
+  }
+}
+
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_flush);
+}
+
+static inline word_t *tcache_get(word_t words) {
+  int index = words / MINBSIZE - 1;
+
+  if (index >= TCACHE_BINS)
+    return NULL;
+
+  tcache_check_gen();
+  void *ptr = tcache.bins[index];
+  if (ptr == NULL)
+    return NULL;
+
+  tcache.bins[index] = *(void **)ptr;
+  tcache.count[index]--;
+  return (word_t *)ptr - 1;
+}
+
+static inline bool tcache_put(word_t *bt) {
+  int index = bt_size(bt) / MINBSIZE - 1;
+
+  if (index >= TCACHE_BINS)
+    return false;
+
+  tcache_check_gen();
+  if (tcache.count[index] == TCACHE_COUNT)
+    return false;
+
+  if (!tcache.registered) {
+    pthread_once(&tcache_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+  }
+
+  void *ptr = bt_payload(bt);
+  *(void **)ptr = tcache.bins[index];
+  tcache.bins[index] = ptr;
+  tcache.count[index]++;
+  return true;
+}
+#else
+#define arena_malloc(words, zero) heap_zalloc(words, zero)
+#define arena_malloc_aligned(words, align) heap_malloc_aligned(words, align)
+#define arena_malloc_hint(words, hint) heap_malloc_hint(words, hint)
+#define arena_free(bt) heap_free(bt)
+#define arena_malloc_batch(words, n, out) heap_malloc_batch(words, n, out)
+#define arena_free_batch(ptrs, n) heap_free_batch(ptrs, n)
+#define arena_resize(bt, words) heap_resize(bt, words)
+#define arena_trim(pad) heap_trim(pad)
+#define arena_of(bt) arena
+#define arena_slab_malloc(size) slab_malloc(size)
+#define arena_slab_free(ptr) slab_free(ptr)
+#define tcache_get(words) NULL
+#define tcache_put(bt) false
+#endif /* !THREADS */
+
+/* huge blocks that have mappings of their own */
+static inline bool bt_huge(word_t *bt) {
+  return (uintptr_t)bt_payload(bt) % HUGE_PAGE == HUGE_OFFSET &&
+         *bt == HUGE_TAG;
+}
+
+static inline struct huge *huge_of(word_t *bt) {
+  return (struct huge *)((char *)bt_payload(bt) - HUGE_OFFSET);
+}
+
+/* Returns the number of payload bytes of the huge block. */
+static inline size_t huge_size(word_t *bt) {
+  return huge_of(bt)->size - HUGE_OFFSET;
+}
+
+/*
+ * huge_malloc - Maps memory for the block and puts it on the list.
+ */
+static void *huge_malloc(size_t size) {
+  size_t pagesize = mem_pagesize();
+
+  /* the length of the mapping doesn't fit in size_t */
+  if (size > SIZE_MAX - HUGE_OFFSET - pagesize) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t len = (HUGE_OFFSET + size + pagesize - 1) & -pagesize;
+
+  struct huge *h = mem_map(len, HUGE_PAGE);
+  if (h == NULL)
+    return NULL;
+
+  h->size = len;
+  h->header = HUGE_TAG;
+
+#ifdef THREADS
+  arena_lock(main_arena);
+#endif
+  h->prev = NULL;
+  h->next = arena->huge;
+  if (h->next)
+    h->next->prev = h;
+  arena->huge = h;
+#ifdef THREADS
+  arena_unlock();
+#endif
+
+  return (char *)h + HUGE_OFFSET;
+}
+
+/*
+ * huge_free - Takes the block off the list and unmaps it.
+ */
+static void huge_free(word_t *bt) {
+  struct huge *h = huge_of(bt);
+
+#ifdef THREADS
+  arena_lock(main_arena);
+#endif
+  if (h->next)
+    h->next->prev = h->prev;
+  if (h->prev)
+    h->prev->next = h->next;
+  else
+    arena->huge = h->next;
+#ifdef THREADS
+  arena_unlock();
+#endif
+
+  mem_unmap(h, h->size);
+}
+
+/*
+ * huge_resize - Resizes the mapping of the block with mremap, so the pages are
+ * 	moved instead of copied. Returns the new payload or NULL on failure.
+ */
+static void *huge_resize(word_t *bt, size_t size) {
+  struct huge *h = huge_of(bt);
+  size_t pagesize = mem_pagesize();
+
+  /* the length of the mapping doesn't fit in size_t */
+  if (size > SIZE_MAX - HUGE_OFFSET - pagesize) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t len = (HUGE_OFFSET + size + pagesize - 1) & -pagesize;
+
+  if (len == h->size)
+    return bt_payload(bt);
+
+  /* neighbors on the list have to point at the new place */
+#ifdef THREADS
+  arena_lock(main_arena);
+#endif
+  if ((h = mem_remap(h, h->size, len)) != NULL) {
+    h->size = len;
+    if (h->next)
+      h->next->prev = h;
+    if (h->prev)
+      h->prev->next = h;
+    else
+      arena->huge = h;
+  }
+#ifdef THREADS
+  arena_unlock();
+#endif
+
+  return (h) ? (char *)h + HUGE_OFFSET : NULL;
+}
+
+#ifdef STATS
+/* Counts the bytes asked for and the bytes the block can hold. Returns ptr. */
+static inline void *stats_alloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return NULL;
+
+#ifdef THREADS
+  word_t *bt = (word_t *)ptr - 1;
+  struct arena *a = (bt_huge(bt)) ? main_arena : arena_of(bt);
+#else
+  struct arena *a = arena;
+#endif
+  __atomic_fetch_add(&a->stats.requested, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&a->stats.allocated, mm_usable_size(ptr),
+                     __ATOMIC_RELAXED);
+  return ptr;
+}
+#else
+#define stats_alloc(ptr, size) (ptr)
+#endif
+
+#ifdef PROFILE
+
+/* Returns the hash of the address, its low bits index the tables. */
+static inline uint32_t profile_hash(void *ptr) {
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15UL >> 32;
+}
+
+static inline uint64_t profile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Draws the bytes to the next sample, exponentially distributed. */
+static long profile_interval(size_t rate) {
+  if (sampler.seed == 0)
+    sampler.seed = (uintptr_t)&sampler ^ profile_now() ^ 1;
+
+  /* xorshift64* */
+  sampler.seed ^= sampler.seed >> 12;
+  sampler.seed ^= sampler.seed << 25;
+  sampler.seed ^= sampler.seed >> 27;
+  double u = ((sampler.seed * 0x2545f4914f6cdd1dUL) >> 11) * 0x1p-53;
+
+  double interval = -log(1 - u) * rate;
+  return (interval < LONG_MAX / 2) ? (long)interval : LONG_MAX / 2;
+}
+
+/* Returns the site of the backtrace, a new one if it wasn't seen yet. */
+static struct profile_site *profile_site(struct profile *p, void **stack,
+                                         int depth) {
+  uint64_t hash = 0xcbf29ce484222325UL;
+  for (int i = 0; i < depth; i++)
+    hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3UL;
+  hash |= 1;
+
+  for (int n = 0, i = hash % PROFILE_SITES; n < PROFILE_SITES;
+       n++, i = (i + 1) % PROFILE_SITES) {
+    struct profile_site *site = &p->sites[i];
+    if (site->hash == 0) {
+      site->hash = hash;
+      site->depth = depth;
+      memcpy(site->stack, stack, depth * sizeof(void *));
+      return site;
+    }
+    if (site->hash == hash && site->depth == depth &&
+        memcmp(site->stack, stack, depth * sizeof(void *)) == 0)
+      return site;
+  }
+  return NULL;
+}
+
+/* Returns the slot of the sampled block or of the first unused one. */
+static struct profile_sample *profile_slot(struct profile *p, void *ptr) {
+  for (uint32_t i = profile_hash(ptr);; i++) {
+    struct profile_sample *s = &p->samples[i % PROFILE_LIVE];
+    if (s->ptr == NULL || s->gen != p->gen || s->ptr == ptr)
+      return s;
+  }
+}
+
+/* Writes the formatted text through the buffer, flushing it when full. */
+static void profile_printf(int fd, char *buf, size_t *len, const char *fmt,
+                           ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + *len, PROFILE_BUF - *len, fmt, ap);
+  va_end(ap);
+
+  if (*len + n >= PROFILE_BUF) {
+    if (write(fd, buf, *len) < 0)
+      return;
+    *len = 0;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, PROFILE_BUF, fmt, ap);
+    va_end(ap);
+  }
+  *len += n;
+}
+
+/*
+ * profile_write - Writes the profile in the legacy heap format of pprof: the
+ * 	live and all sampled blocks of every site and the mappings of the
+ * 	process, which pprof needs to find the symbols. Freed samples and their
+ * 	lifetimes are added as comments.
+ */
+static int profile_write(struct profile *p, int fd) {
+  char buf[PROFILE_BUF];
+  size_t len = 0;
+  size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+
+  for (int i = 0; i < PROFILE_SITES; i++)
+    p->sites[i].live = p->sites[i].live_bytes = 0;
+
+  for (int i = 0; i < PROFILE_LIVE; i++) {
+    struct profile_sample *s = &p->samples[i];
+    if (s->ptr == NULL || s->gen != p->gen)
+      continue;
+    p->sites[s->site].live++;
+    p->sites[s->site].live_bytes += s->size;
+    live++;
+    live_bytes += s->size;
+  }
+
+  for (int i = 0; i < PROFILE_SITES; i++) {
+    allocs += p->sites[i].allocs;
+    alloc_bytes += p->sites[i].alloc_bytes;
+  }
+
+  profile_printf(fd, buf, &len,
+                 "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live,
+                 live_bytes, allocs, alloc_bytes, p->period);
+  profile_printf(fd, buf, &len, "# %zu samples dropped\n", p->dropped);
+
+  for (int i = 0; i < PROFILE_SITES; i++) {
+    struct profile_site *site = &p->sites[i];
+    if (site->hash == 0)
+      continue;
+    profile_printf(fd, buf, &len, "%zu: %zu [%zu: %zu] @", site->live,
+                   site->live_bytes, site->allocs, site->alloc_bytes);
+    for (int j = 0; j < site->depth; j++)
+      profile_printf(fd, buf, &len, " %p", site->stack[j]);
+    profile_printf(fd, buf, &len, "\n");
+    if (site->freed)
+      profile_printf(fd, buf, &len, "# %zu freed, mean lifetime %.3f ms\n",
+                     site->freed, site->lifetime / 1e6 / site->freed);
+  }
+
+  profile_printf(fd, buf, &len, "\nMAPPED_LIBRARIES:\n");
+  if (write(fd, buf, len) < 0)
+    return -1;
+
+  /* copied as it is, without stdio that could allocate */
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps < 0)
+    return -1;
+  ssize_t n;
+  while ((n = read(maps, buf, sizeof(buf))) > 0)
+    if (write(fd, buf, n) < 0)
+      break;
+  close(maps);
+  return (n == 0) ? 0 : -1;
+}
+
+/* Writes the profile to the file the signal was set up with. */
+static void profile_dump_pending(struct profile *p) {
+  p->pending = 0;
+  int fd = open(p->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  profile_write(p, fd);
+  close(fd);
+}
+
+/* Writes the profile if the signal asked for it, even with sampling stopped. */
+static void __attribute__((noinline)) profile_check_pending(struct profile *p) {
+  if (sampler.busy)
+    return;
+  sampler.busy = true;
+  profile_lock(p);
+  if (p->pending)
+    profile_dump_pending(p);
+  profile_unlock(p);
+  sampler.busy = false;
+}
+
+/*
+ * profile_sample - Called when the count of the thread goes below zero. Draws
+ * 	the next interval and records the block with its backtrace, the
+ * 	profile is also dumped here if the signal asked for it.
+ */
+static void __attribute__((noinline)) profile_sample(void *ptr, size_t size) {
+  struct profile *p = __atomic_load_n(&profile, __ATOMIC_ACQUIRE);
+  size_t rate = (p) ? __atomic_load_n(&p->rate, __ATOMIC_RELAXED) : 0;
+
+  if (sampler.busy)
+    return;
+  if (p != NULL && p->pending)
+    profile_check_pending(p);
+  if (rate == 0) {
+    sampler.left = PROFILE_IDLE;
+    return;
+  }
+  sampler.left = profile_interval(rate);
+  if (ptr == NULL)
+    return;
+
+  /* the first backtrace can load the unwinder, which calls malloc */
+  sampler.busy = true;
+  void *stack[PROFILE_SKIP + PROFILE_DEPTH];
+  int depth = backtrace(stack, PROFILE_SKIP + PROFILE_DEPTH) - PROFILE_SKIP;
+  depth = (depth < 0) ? 0 : depth;
+  uint64_t birth = profile_now();
+
+  profile_lock(p);
+  struct profile_site *site = profile_site(p, stack + PROFILE_SKIP, depth);
+  if (site == NULL || p->live >= PROFILE_LIVE / 2) {
+    p->dropped++;
+  } else {
+    struct profile_sample *s = profile_slot(p, ptr);
+    s->ptr = ptr;
+    s->gen = p->gen;
+    s->site = site - p->sites;
+    s->size = size;
+    s->birth = birth;
+    p->live++;
+    site->allocs++;
+    site->alloc_bytes += size;
+
+    uint8_t *count = &p->filter[profile_hash(ptr) % PROFILE_FILTER];
+    if (*count < 255)
+      __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  }
+  profile_unlock(p);
+  sampler.busy = false;
+}
+
+/* Takes the sampled block out of the table, shifting the ones after it back
+ * so that no lookup stops at the hole. */
+static void profile_forget(struct profile *p, void *ptr) {
+  profile_lock(p);
+  struct profile_sample *s = profile_slot(p, ptr);
+
+  if (s->ptr == ptr && s->gen == p->gen) {
+    struct profile_site *site = &p->sites[s->site];
+    site->freed++;
+    site->lifetime += profile_now() - s->birth;
+    p->live--;
+
+    uint8_t *count = &p->filter[profile_hash(ptr) % PROFILE_FILTER];
+    if (*count < 255)
+      __atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+
+    uint32_t hole = s - p->samples;
+    s->ptr = NULL;
+    for (uint32_t i = (hole + 1) % PROFILE_LIVE;; i = (i + 1) % PROFILE_LIVE) {
+      struct profile_sample *next = &p->samples[i];
+      if (next->ptr == NULL || next->gen != p->gen)
+        break;
+      /* a block stays if its home slot is between the hole and its slot */
+      uint32_t home = profile_hash(next->ptr) % PROFILE_LIVE;
+      if ((i - home) % PROFILE_LIVE < (i - hole) % PROFILE_LIVE)
+        continue;
+      p->samples[hole] = *next;
+      next->ptr = NULL;
+      hole = i;
+    }
+  }
+  profile_unlock(p);
+}
+
+/* Forgets the block if it was sampled and writes a profile asked for by the
+ * signal. Costs two loads and branches otherwise. */
+static inline void profile_free(void *ptr) {
+  struct profile *p = __atomic_load_n(&profile, __ATOMIC_RELAXED);
+  if (p == NULL)
+    return;
+  if (__atomic_load_n(&p->filter[profile_hash(ptr) % PROFILE_FILTER],
+                      __ATOMIC_RELAXED))
+    profile_forget(p, ptr);
+  if (p->pending)
+    profile_check_pending(p);
+}
+#else
+#define profile_free(ptr)
+#endif
+
+/* Accounts for a new block of malloc, calloc or memalign. Returns ptr. */
+static inline void *alloc_done(void *ptr, size_t size) {
+#ifdef PROFILE
+  if ((sampler.left -= size) < 0)
+    profile_sample(ptr, size);
+#endif
+  return stats_alloc(ptr, size);
+}
+
+/*
+ * malloc - Allocate a block by incrementing the brk pointer.
+ *      Always allocate a block whose size is a multiple of the alignment.
+ */
+void *malloc(size_t size) {
+  word_t *bt;
+
+  lazy_init();
+
+  if (!size)
+    return NULL;
+
+  if (size >= HUGE_THRESHOLD)
+    return alloc_done(huge_malloc(size), size);
+
+#ifdef SLAB
+  void *ptr;
+  if (size <= SLAB_MAX && (ptr = arena_slab_malloc(size)) != NULL)
+    return alloc_done(ptr, size);
+#endif
+
+  /* headr + playoad + padding (in words) */
+  word_t words = round_up(WSIZE + size) / WSIZE;
+
+  if ((bt = tcache_get(words)) == NULL)
+    bt = arena_malloc(words, 0);
+
+  return alloc_done((bt) ? bt_payload(bt) : NULL, size);
+}
+
+/*
+ * free - Puts the block into the thread cache or gives it back to the heap.
+ */
+void free(void *ptr) {
+
+  if (!ptr)
+    return;
+
+  profile_free(ptr);
+
+  word_t *bt = (word_t *)ptr - 1;
+
+  if (bt_huge(bt)) {
+    huge_free(bt);
+    return;
+  }
+
+#ifdef SLAB
+  if (slab_owns(arena_of(bt), ptr)) {
+    arena_slab_free(ptr);
+    return;
+  }
+#endif
+
+  if (!tcache_put(bt))
+    arena_free(bt);
+}
+
+/*
+ * mm_usable_size - Returns the number of bytes the block can hold, which can
+ * 	be more than was asked for because of rounding and unsplit leftovers.
+ */
+size_t mm_usable_size(void *ptr) {
+
+  if (!ptr)
+    return 0;
+
+  word_t *bt = (word_t *)ptr - 1;
+
+  if (bt_huge(bt))
+    return huge_size(bt);
+
+#ifdef SLAB
+  if (slab_owns(arena_of(bt), ptr))
+    return slab_size(ptr);
+#endif
+
+  return bt_size(bt) * WSIZE - WSIZE;
+}
+
+/*
+ * realloc - Change the size of the block in place if possible. Otherwise
+ *      malloc a new block, copy its data, and free the old block.
+ **/
+void *realloc(void *old_ptr, size_t size) {
+  lazy_init();
+
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  if (!old_ptr)
+    return malloc(size);
+
+  word_t *bt = (word_t *)old_ptr - 1;
+  size_t old_size;
+
+  if (bt_huge(bt)) {
+    /* a block no longer huge moves back to the heap */
+    if (size >= HUGE_THRESHOLD) {
+      void *ptr = huge_resize(bt, size);
+      /* a sample of the block stays only where mremap left it */
+      if (ptr != NULL && ptr != old_ptr)
+        profile_free(old_ptr);
+      return stats_alloc(ptr, size);
+    }
+    old_size = huge_size(bt);
+  }
+#ifdef SLAB
+  else if (slab_owns(arena_of(bt), old_ptr)) {
+    /* slots don't change their size */
+    if ((old_size = slab_size(old_ptr)) >= size)
+      return stats_alloc(old_ptr, size);
+  }
+#endif
+  else if (size < HUGE_THRESHOLD) {
+    word_t words = round_up(WSIZE + size) / WSIZE;
+
+    /* the slack of the block is used without taking the lock */
+    if (words <= bt_size(bt) && bt_size(bt) - words < ALIGNMENT)
+      return stats_alloc(old_ptr, size);
+    if (arena_resize(bt, words))
+      return stats_alloc(old_ptr, size);
+    old_size = bt_size(bt) * WSIZE - WSIZE;
+  } else {
+    /* a block grown into a huge one moves to a mapping of its own */
+    old_size = bt_size(bt) * WSIZE - WSIZE;
+  }
+
+  void *new_ptr = malloc(size);
+  if (!new_ptr)
+    return NULL;
+
+  /* Copy the old data. */
+  memcpy(new_ptr, old_ptr, (old_size < size) ? old_size : size);
+
+  /* Free the old block. */
+  free(old_ptr);
+
+  return new_ptr;
+}
+
+/*
+ * calloc - Allocate the block and set it to zero. Returns NULL if the size
+ *      overflows. Memory that was never handed out is not cleared again.
+ */
+void *calloc(size_t nmemb, size_t size) {
+  size_t bytes;
+  word_t *bt;
 
-    bt = segregated_list[index];
+  lazy_init();
 
-    /* searching in the selected bucket */
-    while (bt != NULL) {
-      if (bt_size(bt) >= words)
-        return bt;
+  /* the size doesn't fit in size_t */
+  if (__builtin_mul_overflow(nmemb, size, &bytes) || !bytes)
+    return NULL;
 
-      bt = get_free_list_next(bt);
-    }
-    index++;
+  /* new mappings are zeroed by the system */
+  if (bytes >= HUGE_THRESHOLD)
+    return alloc_done(huge_malloc(bytes), bytes);
 
-  } while (index < N_BUCKETS);
-  return NULL;
+#ifdef SLAB
+  void *ptr;
+  if (bytes <= SLAB_MAX && (ptr = arena_slab_malloc(bytes)) != NULL) {
+    memset(ptr, 0, bytes);
+    return alloc_done(ptr, bytes);
+  }
+#endif
+
+  word_t words = round_up(WSIZE + bytes) / WSIZE;
+
+  /* cached blocks were used before, the heap clears only what's dirty */
+  if ((bt = tcache_get(words)) != NULL)
+    memset(bt_payload(bt), 0, bytes);
+  else
+    bt = arena_malloc(words, bytes);
+
+  return alloc_done((bt) ? bt_payload(bt) : NULL, bytes);
 }
 
 /*
- * malloc - Allocate a block by incrementing the brk pointer.
- *      Always allocate a block whose size is a multiple of the alignment.
+ * memalign - Allocate a block with the payload aligned to align bytes, which
+ *      has to be a power of two. Returns NULL and sets errno otherwise. Huge
+ *      blocks aligned to more than HUGE_OFFSET bytes are taken from the heap,
+ *      so they fail with ENOMEM above MAX_HEAP.
  */
-void *malloc(size_t size) {
+void *memalign(size_t align, size_t size) {
   word_t *bt;
 
+  lazy_init();
+
+  if (align == 0 || (align & (align - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (align <= ALIGNMENT)
+    return malloc(size);
+
   if (!size)
     return NULL;
 
-  /* headr + playoad + padding (in bytes) */
-  size = round_up(WSIZE + size);
-  /* headr + playoad + padding (in words) */
-  word_t words = size / WSIZE;
+  /* payloads of huge blocks sit at a fixed offset in the page */
+  if (size >= HUGE_THRESHOLD && align <= HUGE_OFFSET)
+    return alloc_done(huge_malloc(size), size);
 
-  /* Search the free list for a fit */
-  if ((bt = find_fit(words)) != NULL) {
-    place(bt, words);
-    return (void *)(bt + 1);
+  /* bigger alignments come from the heap, which can't be bigger than that */
+  if (size > MAX_HEAP) {
+    errno = ENOMEM;
+    return NULL;
   }
 
-  // size (bytes) needed to extend_heap
-  size_t needed = size;
+#ifdef SLAB
+  /* slots of sizes that are multiples of align are aligned to it too */
+  size_t slot = (size + align - 1) & -align;
+  void *ptr;
+  if (slot <= SLAB_MAX && SLAB_HEADER % align == 0 &&
+      (ptr = arena_slab_malloc(slot)) != NULL)
+    return alloc_done(ptr, size);
+#endif
 
-  if (last != NULL && !bt_used(last))
-    needed = size - bt_size(last) * WSIZE;
+  /* the block with the slack for moving it has to fit in a block size */
+  size_t words = round_up(WSIZE + size) / WSIZE;
+  if (words + (align - ALIGNMENT) / WSIZE > INT32_MAX) {
+    errno = ENOMEM;
+    return NULL;
+  }
 
-  if ((bt = extend_heap(needed)) == NULL)
+  bt = arena_malloc_aligned(words, align);
+
+  if (bt == NULL) {
+    errno = ENOMEM;
     return NULL;
+  }
+  return alloc_done(bt_payload(bt), size);
+}
 
-  place(bt, words);
+/*
+ * posix_memalign - Like memalign, but align has to be a multiple of the
+ *      pointer size too and the error code is returned.
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+
+  if (!align || align % sizeof(void *) || (align & (align - 1)))
+    return EINVAL;
+
+  if (!size) {
+    *memptr = NULL;
+    return 0;
+  }
+
+  void *ptr = memalign(align, size);
+  if (ptr == NULL)
+    return ENOMEM;
 
-  return (void *)(bt + 1);
+  *memptr = ptr;
+  return 0;
 }
 
 /*
- * free - We don't know how to free a block.  So we ignore this call.
- *      Computers have big memories; surely it won't be a problem.
+ * aligned_alloc - The C11 name of memalign.
  */
-void free(void *ptr) {
+void *aligned_alloc(size_t align, size_t size) {
+  return memalign(align, size);
+}
 
-  if (!ptr)
-    return;
+#ifndef DRIVER
+/*
+ * The rest of the glibc interface, so programs that call it get the blocks of
+ * this allocator too.
+ */
+size_t malloc_usable_size(void *ptr) {
+  return mm_usable_size(ptr);
+}
 
-  word_t *bt = (word_t *)ptr - 1;
+void *valloc(size_t size) {
+  return memalign(mem_pagesize(), size);
+}
 
-  bt_flags flags = FREE | bt_get_prevfree(bt);
+void *pvalloc(size_t size) {
+  size_t pagesize = mem_pagesize();
+  return memalign(pagesize, (size + pagesize - 1) & -pagesize);
+}
+#endif
 
-  bt_make(bt, bt_size(bt), flags);
+/*
+ * mm_malloc_batch - Allocates n blocks of the same size, storing their
+ * 	payloads in out. The blocks are cut from the heap together, huge blocks
+ * 	and slots are allocated one by one. Returns the number of blocks
+ * 	allocated, which is less than n only if the memory ran out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+  size_t count = 0;
+  word_t *bt;
 
-  /* coalescing free neighbors */
-  if (bt_get_prevfree(bt) || (bt_next(bt) && bt_used(bt_next(bt))))
-    coalesce(bt);
-  else
-    free_list_append(bt);
+  lazy_init();
+
+  if (!size)
+    return 0;
+
+  if (size >= HUGE_THRESHOLD
+#ifdef SLAB
+      || size <= SLAB_MAX
+#endif
+  ) {
+    while (count < n && (out[count] = malloc(size)) != NULL)
+      count++;
+    return count;
+  }
+
+  word_t words = round_up(WSIZE + size) / WSIZE;
+
+  while (count < n && (bt = tcache_get(words)) != NULL)
+    out[count++] = bt_payload(bt);
+
+  count += arena_malloc_batch(words, n - count, out + count);
+  for (size_t i = 0; i < count; i++)
+    alloc_done(out[i], size);
+  return count;
+}
+
+/* Returns true if the payload belongs to a boundary tag block of a heap. */
+static inline bool in_heap(void *ptr) {
+  word_t *bt = (word_t *)ptr - 1;
+
+  if (ptr == NULL || bt_huge(bt))
+    return false;
+#ifdef SLAB
+  if (slab_owns(arena_of(bt), ptr))
+    return false;
+#endif
+  return true;
+}
+
+static int ptr_compare(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(void *const *)a;
+  uintptr_t y = (uintptr_t)*(void *const *)b;
+  return (x > y) - (x < y);
 }
 
 /*
- * realloc - Change the size of the block by mallocing a new block,
- *      copying its data, and freeing the old block.
- **/
-void *realloc(void *old_ptr, size_t size) {
+ * mm_malloc_hint - Allocates the block like malloc, placed where the hint asks
+ * 	for: MM_HINT_SHORT with the other short-lived blocks at the top of the
+ * 	heap, MM_HINT_LONG out of their way and any other hint is a live block to
+ * 	put it next to. Hinted blocks skip the caches. Huge blocks and hints to
+ * 	blocks outside of the heaps are allocated by malloc.
+ */
+void *mm_malloc_hint(size_t size, const void *hint) {
+  word_t *bt;
 
-  if (size == 0) {
-    free(old_ptr);
+  lazy_init();
+
+  if (!size)
     return NULL;
-  }
 
-  if (!old_ptr)
+  if (hint == MM_HINT_NONE || size >= HUGE_THRESHOLD ||
+      (hint != MM_HINT_SHORT && hint != MM_HINT_LONG &&
+       !in_heap((void *)hint)))
     return malloc(size);
 
-  word_t *bt = (word_t *)old_ptr - 1;
+  word_t words = round_up(WSIZE + size) / WSIZE;
+  bt = arena_malloc_hint(words, hint);
 
-  void *new_ptr = malloc(size);
-  if (!new_ptr)
+  return alloc_done((bt) ? bt_payload(bt) : NULL, size);
+}
+
+/*
+ * mm_free_batch - Frees n blocks. The array is sorted by address in place, so
+ * 	the blocks of each arena come in a row and neighbors in memory are
+ * 	coalesced together in one sweep.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+
+  /* blocks are often freed in the order they were allocated in */
+  for (size_t i = 1; i < n; i++) {
+    if ((uintptr_t)ptrs[i - 1] > (uintptr_t)ptrs[i]) {
+      qsort(ptrs, n, sizeof(void *), ptr_compare);
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < n;) {
+    if (!in_heap(ptrs[i])) {
+      free(ptrs[i++]);
+      continue;
+    }
+
+    struct arena *a = arena_of((word_t *)ptrs[i] - 1);
+    size_t j = i + 1;
+    while (j < n && in_heap(ptrs[j]) && arena_of((word_t *)ptrs[j] - 1) == a)
+      j++;
+
+    for (size_t k = i; k < j; k++)
+      profile_free(ptrs[k]);
+    arena_free_batch(ptrs + i, j - i);
+    i = j;
+  }
+}
+
+/* Returns the first byte of the chunk allocations can take. */
+static inline char *region_start(struct mm_region *r, struct region_chunk *c) {
+  if (c == r->chunks)
+    return (char *)r + round_up(sizeof(struct mm_region));
+  return (char *)c + REGION_HEADER;
+}
+
+/* Makes the chunk the current one with size bytes of it taken. */
+static inline void *region_enter(struct mm_region *r, struct region_chunk *c,
+                                 size_t size) {
+  r->current = c;
+  r->ptr = region_start(r, c) + size;
+  r->end = (char *)c + c->size;
+  return r->ptr - size;
+}
+
+/* Frees the chunks of big allocations. */
+static void region_free_big(struct mm_region *r) {
+  while (r->big != NULL) {
+    struct region_chunk *c = r->big;
+    r->big = c->next;
+    free(c);
+  }
+}
+
+/*
+ * mm_region_create - Makes an empty region with its first chunk. Returns NULL
+ * 	if there is no memory for it.
+ */
+struct mm_region *mm_region_create(void) {
+  struct region_chunk *c = malloc(REGION_CHUNK - WSIZE);
+
+  if (c == NULL)
     return NULL;
 
-  size_t free_size = bt_size((word_t *)new_ptr - 1) * WSIZE;
-  size_t old_size = bt_size(bt) * WSIZE;
+  c->next = NULL;
+  c->size = REGION_CHUNK - WSIZE;
 
-  /* Copy the old data. */
-  if (free_size > old_size)
-    memcpy(new_ptr, old_ptr, old_size - WSIZE);
-  else
-    memcpy(new_ptr, old_ptr, free_size - WSIZE);
+  struct mm_region *r = (struct mm_region *)((char *)c + REGION_HEADER);
+  r->chunks = c;
+  r->big = NULL;
+  region_enter(r, c, 0);
+  return r;
+}
 
-  /* Free the old block. */
-  free(old_ptr);
+/*
+ * mm_region_alloc - Bumps the pointer of the current chunk. When the chunk is
+ * 	full the next one is taken, either kept from before the last reset or
+ * 	a new one. Returns NULL if there is no memory left.
+ */
+void *mm_region_alloc(struct mm_region *r, size_t size) {
+  struct region_chunk *c;
 
-  return new_ptr;
+  if (!size || size > PTRDIFF_MAX)
+    return NULL;
+
+  size = round_up(size);
+
+  if (size <= (size_t)(r->end - r->ptr)) {
+    r->ptr += size;
+    return r->ptr - size;
+  }
+
+  /* big allocations don't waste the rest of the chunk */
+  if (size > REGION_BIG) {
+    if ((c = malloc(REGION_HEADER + size)) == NULL)
+      return NULL;
+    c->next = r->big;
+    c->size = REGION_HEADER + size;
+    r->big = c;
+    return (char *)c + REGION_HEADER;
+  }
+
+  if ((c = r->current->next) == NULL) {
+    if ((c = malloc(REGION_CHUNK - WSIZE)) == NULL)
+      return NULL;
+    c->next = NULL;
+    c->size = REGION_CHUNK - WSIZE;
+    r->current->next = c;
+  }
+
+  return region_enter(r, c, size);
 }
 
 /*
- * calloc - Allocate the block and set it to zero.
+ * mm_region_reset - Frees everything allocated in the region at once. The
+ * 	chunks are kept to be bumped through again, only the chunks of big
+ * 	allocations are given back.
  */
-void *calloc(size_t nmemb, size_t size) {
+void mm_region_reset(struct mm_region *r) {
+  region_free_big(r);
+  region_enter(r, r->chunks, 0);
+}
+
+/*
+ * mm_region_destroy - Gives all chunks of the region back, the first one with
+ * 	the region itself last.
+ */
+void mm_region_destroy(struct mm_region *r) {
+  region_free_big(r);
+
+  struct region_chunk *c = r->chunks->next;
+  while (c != NULL) {
+    struct region_chunk *next = c->next;
+    free(c);
+    c = next;
+  }
+  free(r->chunks);
+}
 
-  size_t bytes = nmemb * size;
-  void *new_ptr = malloc(bytes);
+/*
+ * mm_trim - Gives free memory back to the system. The free tail of the heap is
+ * 	cut down to pad bytes and the pages inside other big free blocks are
+ * 	released, only their boundary tags and free list links stay in place.
+ * 	Returns 1 if any memory was released, 0 otherwise.
+ */
+int mm_trim(size_t pad) {
+  lazy_init();
 
-  /* If malloc() fails, skip zeroing out the memory. */
-  if (new_ptr)
-    memset(new_ptr, 0, bytes);
+#ifdef THREADS
+  tcache_flush(&tcache);
+#endif
 
-  return new_ptr;
+  return arena_trim(pad);
+}
+
+#ifdef THREADS
+/*
+ * mm_arena_stats - Fills in the lock statistics of arena i counted since
+ * 	mm_init, all zero if the arena isn't mapped yet. Returns -1 if there is
+ * 	no such arena, 0 otherwise.
+ */
+int mm_arena_stats(int i, struct mm_arena_stats *st) {
+  lazy_init();
+
+  if (i < 0 || i >= N_ARENAS)
+    return -1;
+
+  struct arena *a =
+    __atomic_load_n(&main_arena->arenas[i], __ATOMIC_ACQUIRE);
+  st->locks = (a) ? __atomic_load_n(&a->locks, __ATOMIC_RELAXED) : 0;
+  st->contended = (a) ? __atomic_load_n(&a->contended, __ATOMIC_RELAXED) : 0;
+  st->remote = (a) ? __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) : 0;
+  return 0;
+}
+#endif
+
+#ifdef STATS
+/* Returns the size of the biggest free block of the arena in words. */
+static word_t largest_free(void) {
+  word_t largest = 0;
+
+#ifdef TLSF
+  /* the blocks of the highest list are compared with each other */
+  if (arena->tlsf.fl_bitmap == 0)
+    return 0;
+  int fl = 31 - __builtin_clz(arena->tlsf.fl_bitmap);
+  int sl = 31 - __builtin_clz(arena->tlsf.sl_bitmap[fl]);
+  for (word_t *bt = bt_at(arena, arena->tlsf.heads[fl][sl]); bt != NULL;
+       bt = get_free_list_next(bt))
+    largest = (bt_size(bt) > largest) ? bt_size(bt) : largest;
+#else
+  /* the rightmost block of the tree or the biggest of the highest bucket */
+  word_t *bt = tree_root();
+  if (bt != NULL) {
+    while (tree_child(bt, 1) != NULL)
+      bt = tree_child(bt, 1);
+    return bt_size(bt);
+  }
+
+  for (int index = TOP_BUCKET - 1; index >= 0 && largest == 0; index--) {
+#ifdef FIT_INDEX
+    struct fit_bucket *b = &arena->fit[index];
+    for (int i = 0; i < b->count; i++)
+      largest = (b->sizes[i] > largest) ? b->sizes[i] : largest;
+#else
+    if (arena->segregated_list[index] == arena->heap_start - 1)
+      continue;
+    for (bt = arena->segregated_list[index]; bt != NULL;
+         bt = get_free_list_next(bt))
+      largest = (bt_size(bt) > largest) ? bt_size(bt) : largest;
+#endif
+  }
+#endif /* !TLSF */
+
+  return largest;
+}
+
+/* Adds the counters of the arena to the statistics. */
+static void stats_add(struct mm_stats *st) {
+  struct stats *s = &arena->stats;
+
+  st->heap_bytes += (char *)(arena->heap_epilogue + 1) - (char *)arena;
+  for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+    st->free_blocks[i] += s->free_blocks[i];
+    st->free_bytes[i] += s->free_bytes[i];
+  }
+  for (int i = 0; i < MM_STATS_PROBES; i++)
+    st->probes[i] += s->probes[i];
+
+  size_t largest = largest_free() * WSIZE;
+  st->largest_free = (largest > st->largest_free) ? largest : st->largest_free;
+  st->splits += s->splits;
+  st->coalesces += s->coalesces;
+  st->extends += s->extends;
+  st->extend_bytes += s->extend_bytes;
+  st->trims += s->trims;
+  st->requested += __atomic_load_n(&s->requested, __ATOMIC_RELAXED);
+  st->allocated += __atomic_load_n(&s->allocated, __ATOMIC_RELAXED);
+}
+
+/* Checks the free block counters against the blocks of the arena. */
+static void stats_check(void) {
+  size_t blocks[MM_STATS_BUCKETS] = {0}, bytes[MM_STATS_BUCKETS] = {0};
+
+  for (word_t *bt = arena->heap_start; arena->last != NULL && bt != NULL;
+       bt = bt_next(bt)) {
+    if (bt_used(bt))
+      continue;
+    blocks[find_bucket(bt_size(bt))]++;
+    bytes[find_bucket(bt_size(bt))] += bt_size(bt) * WSIZE;
+  }
+
+  for (int i = 0; i < MM_STATS_BUCKETS; i++)
+    assert(blocks[i] == arena->stats.free_blocks[i] &&
+           bytes[i] == arena->stats.free_bytes[i] &&
+           "statystyki niezgodne ze sterta");
+}
+#endif
+
+/*
+ * mm_stats - Fills in the statistics of all arenas and huge blocks. The free
+ * 	blocks are counted as the lists change, only the largest one is looked
+ * 	for, each arena is locked while it is read. The thread caches and fast
+ * 	bins hold blocks that count as used. Returns -1 with everything zero if
+ * 	the allocator was built without STATS.
+ */
+int mm_stats(struct mm_stats *st) {
+  memset(st, 0, sizeof(*st));
+
+#ifdef STATS
+  lazy_init();
+
+#ifdef THREADS
+  for (int i = 0; i < N_ARENAS; i++) {
+    struct arena *a =
+      __atomic_load_n(&main_arena->arenas[i], __ATOMIC_ACQUIRE);
+    if (a == NULL)
+      continue;
+    arena_lock(a);
+    stats_add(st);
+    arena_unlock();
+  }
+
+  arena_lock(main_arena);
+#else
+  stats_add(st);
+#endif
+  for (struct huge *h = arena->huge; h != NULL; h = h->next) {
+    st->huge_blocks++;
+    st->huge_bytes += h->size;
+  }
+#ifdef THREADS
+  arena_unlock();
+#endif
+
+  size_t free_bytes = 0;
+  for (int i = 0; i < MM_STATS_BUCKETS; i++)
+    free_bytes += st->free_bytes[i];
+  for (int i = 0; i < CLASS_COUNT; i++)
+    st->class_bytes[i] = class_limits[i];
+
+  st->internal =
+    (st->allocated) ? 1 - (double)st->requested / st->allocated : 0;
+  st->external =
+    (free_bytes) ? 1 - (double)st->largest_free / free_bytes : 0;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+#ifdef PROFILE
+/* Asks for a dump, only a flag is set in the signal handler. */
+static void profile_signal(int signo) {
+  (void)signo;
+  if (profile != NULL)
+    profile->pending = 1;
+}
+#endif
+
+/*
+ * mm_profile_start - Starts sampling a block every rate bytes on average,
+ * 	mapping the profile on the first call. Samples taken before are kept.
+ * 	Returns -1 if there is no memory for the profile or if the allocator was
+ * 	built without PROFILE.
+ */
+int mm_profile_start(size_t rate) {
+#ifdef PROFILE
+  lazy_init();
+
+  if (rate == 0 || rate > LONG_MAX / 2)
+    return -1;
+
+  if (profile == NULL) {
+    /* kept out of the heap, so the profile isn't counted as its memory */
+    struct profile *p = mmap(NULL, sizeof(struct profile),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return -1;
+#ifdef THREADS
+    pthread_mutex_init(&p->lock, NULL);
+#endif
+    struct profile *other = NULL;
+    if (!__atomic_compare_exchange_n(&profile, &other, p, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      munmap(p, sizeof(struct profile));
+
+    /* the unwinder is loaded now and not by the first sample */
+    void *stack[1];
+    backtrace(stack, 1);
+  }
+
+  profile_lock(profile);
+  profile->period = rate;
+  __atomic_store_n(&profile->rate, rate, __ATOMIC_RELAXED);
+  profile_unlock(profile);
+  sampler.left = profile_interval(rate);
+  return 0;
+#else
+  (void)rate;
+  return -1;
+#endif
+}
+
+/*
+ * mm_profile_stop - Stops sampling, the blocks sampled already are still
+ * 	followed until they are freed. Other threads notice it by their next
+ * 	sample.
+ */
+void mm_profile_stop(void) {
+#ifdef PROFILE
+  if (profile != NULL) {
+    __atomic_store_n(&profile->rate, 0, __ATOMIC_RELAXED);
+    if (profile->pending)
+      profile_check_pending(profile);
+  }
+#endif
 }
 
 /*
- * mm_checkheap - So simple, it doesn't need a checker!
+ * mm_profile_dump - Writes the profile to the file descriptor in the heap
+ * 	format of pprof. Returns -1 if it couldn't be written or there is no
+ * 	profile, 0 otherwise.
+ */
+int mm_profile_dump(int fd) {
+#ifdef PROFILE
+  if (profile == NULL)
+    return -1;
+
+  sampler.busy = true;
+  profile_lock(profile);
+  int ret = profile_write(profile, fd);
+  profile_unlock(profile);
+  sampler.busy = false;
+  return ret;
+#else
+  (void)fd;
+  return -1;
+#endif
+}
+
+/*
+ * mm_profile_signal - Makes the signal dump the profile to the file at path.
+ * 	The handler only asks for the dump, it is written by the next sample or
+ * 	free of any thread or by mm_profile_stop, where no lock of the allocator
+ * 	is held. Returns -1 if the profile wasn't started or the handler couldn't
+ * 	be installed.
+ */
+int mm_profile_signal(int signo, const char *path) {
+#ifdef PROFILE
+  if (profile == NULL || strlen(path) >= sizeof(profile->path))
+    return -1;
+
+  profile_lock(profile);
+  strcpy(profile->path, path);
+  profile_unlock(profile);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(signo, &sa, NULL);
+#else
+  (void)signo;
+  (void)path;
+  return -1;
+#endif
+}
+
+/* Checks that the mark of the short-lived blocks is at a used block. */
+static void nursery_check(void) {
+  word_t *nursery = nursery_get();
+  word_t *bt = arena->heap_start;
+
+  if (nursery == NULL)
+    return;
+
+  while (bt != NULL && bt < nursery)
+    bt = bt_next(bt);
+  assert(bt == nursery && bt_used(bt) &&
+         "nursery nie wskazuje na zajety blok");
+}
+
+/*
+ * mm_checkheap - So simple, it doesn't need a checker! Only the list of huge
+ * 	blocks is walked to see every block is still tagged as huge, the mark of
+ * 	the short-lived blocks of every arena is looked for and, with STATS, the
+ * 	free blocks are counted again and compared with the statistics.
  */
 void mm_checkheap(int verbose) {
+  size_t count = 0, bytes = 0;
+
+  lazy_init();
+
+#ifdef THREADS
+  arena_lock(main_arena);
+#endif
+  for (struct huge *h = arena->huge; h != NULL; h = h->next) {
+    assert(bt_huge(&h->header) && "zepsuty blok huge");
+    count++;
+    bytes += h->size;
+  }
+#ifdef THREADS
+  arena_unlock();
+#endif
+
+#ifdef THREADS
+  for (int i = 0; i < N_ARENAS; i++) {
+    struct arena *a =
+      __atomic_load_n(&main_arena->arenas[i], __ATOMIC_ACQUIRE);
+    if (a == NULL)
+      continue;
+    arena_lock(a);
+    nursery_check();
+    STAT(stats_check());
+    arena_unlock();
+  }
+#else
+  nursery_check();
+  STAT(stats_check());
+#endif
+
+  if (verbose)
+    msg("huge blocks: %zu (%zu bytes)\n", count, bytes);
   msg("ok\n");
 }
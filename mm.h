@@ -7,6 +7,9 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
 
 #else
 
@@ -15,11 +18,83 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Gives free memory back to the system keeping pad bytes at the heap top. */
+extern int mm_trim(size_t pad);
+
+/* Returns how many bytes the block can hold, at least as many as requested. */
+extern size_t mm_usable_size(void *ptr);
+
+/* Allocates n blocks of size bytes at once. Returns how many were allocated. */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Allocates a block placed as the hint asks, any other hint is a live block
+   to put the new one next to. */
+#define MM_HINT_NONE ((const void *)0)  /* placed like by malloc */
+#define MM_HINT_SHORT ((const void *)1) /* dies soon, kept at the heap top */
+#define MM_HINT_LONG ((const void *)2)  /* lives long, kept out of their way */
+extern void *mm_malloc_hint(size_t size, const void *hint);
+
+/* Frees n blocks at once. The array gets sorted by address. */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Regions hand out memory that is all freed at once by a reset. */
+struct mm_region;
+extern struct mm_region *mm_region_create(void);
+extern void *mm_region_alloc(struct mm_region *r, size_t size);
+extern void mm_region_reset(struct mm_region *r);
+extern void mm_region_destroy(struct mm_region *r);
+
+/* Heap statistics, counted only when built with -DSTATS. */
+#define MM_STATS_BUCKETS 10 /* size classes of the free lists */
+#define MM_STATS_PROBES 16  /* find_fit looked at 0, 1, 2-3, ... blocks */
+struct mm_stats {
+  size_t heap_bytes;                    /* size of all heaps */
+  size_t huge_blocks;                   /* blocks with mappings of their own */
+  size_t huge_bytes;                    /* ... and the size of the mappings */
+  size_t free_blocks[MM_STATS_BUCKETS]; /* free blocks by size class */
+  size_t free_bytes[MM_STATS_BUCKETS];  /* ... and their bytes */
+  size_t class_bytes[MM_STATS_BUCKETS]; /* upper bounds, 0 for the top one */
+  size_t largest_free;                  /* bytes of the biggest free block */
+  size_t probes[MM_STATS_PROBES];       /* find_fit calls by blocks looked at */
+  size_t splits;                        /* free blocks cut by allocations */
+  size_t coalesces;                     /* free neighbors merged */
+  size_t extends;                       /* times the heap grew */
+  size_t extend_bytes;                  /* ... and by how much */
+  size_t trims;                         /* times the heap top was given back */
+  size_t requested;                     /* bytes asked for since mm_init */
+  size_t allocated;                     /* ... and the bytes handed out */
+  double internal;                      /* 1 - requested / allocated */
+  double external;                      /* 1 - largest_free / free bytes */
+};
+extern int mm_stats(struct mm_stats *st);
+
+/* Sampling heap profiler, works only when built with -DPROFILE. */
+extern int mm_profile_start(size_t rate); /* mean bytes between samples */
+extern void mm_profile_stop(void);
+extern int mm_profile_dump(int fd); /* in the heap format of pprof */
+extern int mm_profile_signal(int signo, const char *path);
+
+#ifdef THREADS
+/* Lock statistics of one arena. */
+struct mm_arena_stats {
+  size_t locks;     /* times the arena lock was taken */
+  size_t contended; /* times a thread found it held by another one */
+  size_t remote;    /* blocks freed by threads using other arenas */
+};
+extern int mm_arena_stats(int i, struct mm_arena_stats *st);
+#endif
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
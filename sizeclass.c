@@ -0,0 +1,392 @@
+/*
+ * sizeclass.c - Fits the size classes of the free lists to malloc traces
+ *
+ * The traces are replayed without an allocator, only the sizes of the live
+ * blocks are followed. A block is the request plus the header rounded up to
+ * a granule of 16 bytes. Every block adds its lifetime, counted in requests,
+ * to the histogram of its size, so the histogram tells how many blocks of
+ * each size are live on average. Each trace is scaled to count the same.
+ *
+ * The lists below the top bucket of mm.c get one interval of sizes each, the
+ * last one ends at the size given by -m and bigger blocks go to the tree. A
+ * list costs the bytes its blocks could waste, if every request took a block
+ * as big as the list allows, relative to all live bytes, plus the weight
+ * given by -w times the square of its share of the live blocks, as a request
+ * looks at about as many blocks as the list holds. The intervals with the
+ * lowest total cost are picked by dynamic programming.
+ *
+ * The output is a header for mm.c with the upper bounds of the classes and a
+ * table mapping the block size in granules to its class.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define MAXLINE 1024          /* max string size */
+#define GRANULE 16            /* block sizes are multiples of that */
+#define HEADER 4              /* bytes of the block header */
+#define CLASSES 9             /* lists below the top bucket of mm.c */
+#define MAX_LIMIT (64 * 1024) /* max upper bound of the last list */
+#define MAX_GRANULES (MAX_LIMIT / GRANULE)
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* A block of the replayed trace */
+typedef struct {
+  long birth;      /* request that allocated it, -1 if it isn't live */
+  size_t granules; /* its size */
+} block_t;
+
+/********************
+ * Global variables
+ *******************/
+
+static int limit = 4096 / GRANULE;    /* upper bound of the last list */
+static double hist[MAX_GRANULES + 1]; /* live blocks by size in granules */
+static double above;                  /* live granules in the top bucket */
+
+/* Live blocks and granules of the current trace, scaled when it ends */
+static double trace_hist[MAX_GRANULES + 1];
+static double trace_above;
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void usage(void);
+static void app_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+static void unix_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+
+/*****************
+ * Reading traces
+ *****************/
+
+/*
+ * replay - Follows one request. The block that goes away adds its lifetime
+ *    to the histogram, an allocation or realloc starts a new one.
+ */
+static void replay(block_t *blocks, long now, uint32_t type, uint64_t size) {
+  if (blocks->birth >= 0) {
+    double life = now - blocks->birth;
+    if (blocks->granules <= (size_t)limit)
+      trace_hist[blocks->granules] += life;
+    else
+      trace_above += life * blocks->granules;
+    blocks->birth = -1;
+  }
+
+  if (type != FREE && size > 0) {
+    blocks->birth = now;
+    blocks->granules = (size + HEADER + GRANULE - 1) / GRANULE;
+  }
+}
+
+/*
+ * read_trace - Replays a text or binary trace and adds its histogram, scaled
+ *    to one average live granule, to the global one
+ */
+static void read_trace(const char *filename) {
+  FILE *file;
+  if (!(file = fopen(filename, "r")))
+    unix_error("Could not open %s", filename);
+
+  long num_ids, num_ops;
+  /* only the first character is peeked as the file can be a pipe */
+  trace_header_t header;
+  int c = getc(file);
+  int binary = c == TRACE_MAGIC[0];
+  ungetc(c, file);
+  if (binary) {
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+      app_error("%s: bad header of a binary trace\n", filename);
+    num_ids = header.num_ids;
+    num_ops = header.num_ops;
+  } else {
+    int weight, ignore_ranges;
+    if (fscanf(file, "%d %ld %ld %d", &weight, &num_ids, &num_ops,
+               &ignore_ranges) != 4 ||
+        num_ids < 0 || num_ops < 0)
+      app_error("%s: bad header\n", filename);
+  }
+
+  block_t *blocks;
+  if (!(blocks = malloc((num_ids + 1) * sizeof(block_t))))
+    unix_error("malloc failed in read_trace");
+  for (long i = 0; i < num_ids; i++)
+    blocks[i].birth = -1;
+  memset(trace_hist, 0, sizeof(trace_hist));
+  trace_above = 0;
+
+  long now;
+  for (now = 0; now < num_ops; now++) {
+    traceop_t op;
+    if (binary) {
+      if (fread(&op, sizeof(op), 1, file) != 1)
+        app_error("%s: the trace ends after %ld requests\n", filename, now);
+    } else {
+      char type[MAXLINE];
+      int index;
+      unsigned size = 0;
+      if (fscanf(file, "%1023s %d", type, &index) != 2 ||
+          (type[0] != 'f' && fscanf(file, "%u", &size) != 1))
+        app_error("%s: the trace ends after %ld requests\n", filename, now);
+      switch (type[0]) {
+        case 'a': op.type = ALLOC; break;
+        case 'r': op.type = REALLOC; break;
+        case 'f': op.type = FREE; break;
+        default:
+          app_error("%s: bogus type character (%c)\n", filename, type[0]);
+      }
+      op.index = index;
+      op.size = size;
+    }
+    if (op.type == FREE && op.index < 0) /* free(NULL) */
+      continue;
+    if (op.index < 0 || op.index >= num_ids)
+      app_error("%s: index %d out of range\n", filename, op.index);
+    replay(&blocks[op.index], now, op.type, op.size);
+  }
+
+  /* blocks never freed live until the end */
+  for (long i = 0; i < num_ids; i++)
+    replay(&blocks[i], now, FREE, 0);
+  free(blocks);
+  fclose(file);
+
+  double total = trace_above;
+  for (int g = 1; g <= limit; g++)
+    total += g * trace_hist[g];
+  if (total == 0)
+    return;
+
+  for (int g = 1; g <= limit; g++)
+    hist[g] += trace_hist[g] / total;
+  above += trace_above / total;
+}
+
+/*******************
+ * Fitting classes
+ *******************/
+
+static double count[MAX_GRANULES + 1];  /* live blocks up to each size... */
+static double volume[MAX_GRANULES + 1]; /* ... and their granules */
+static double lambda = 1;               /* search weight (set by -w) */
+
+/* Returns the cost of the list of blocks of a + 1 to b granules. */
+static double cost(int a, int b) {
+  double blocks = count[b] - count[a];
+  double waste = b * blocks - (volume[b] - volume[a]);
+  double share = blocks / count[limit];
+  return waste / (volume[limit] + above) + lambda * share * share;
+}
+
+/* Returns the cost of all lists ending at the given bounds. */
+static double total_cost(const int *bounds) {
+  double sum = 0;
+  for (int i = 0, a = 0; i < CLASSES; a = bounds[i++])
+    sum += cost(a, bounds[i]);
+  return sum;
+}
+
+/*
+ * fit - Picks the bounds with the lowest total cost. best[k][b] is the
+ *    least cost of k + 1 lists covering sizes up to b, from[k][b] is where
+ *    the last of them starts.
+ */
+static void fit(int *bounds) {
+  static double best[CLASSES][MAX_GRANULES + 1];
+  static int from[CLASSES][MAX_GRANULES + 1];
+
+  for (int b = 1; b <= limit; b++)
+    best[0][b] = cost(0, b);
+
+  for (int k = 1; k < CLASSES; k++)
+    for (int b = k + 1; b <= limit; b++) {
+      best[k][b] = -1;
+      for (int a = k; a < b; a++) {
+        double c = best[k - 1][a] + cost(a, b);
+        if (best[k][b] < 0 || c < best[k][b]) {
+          best[k][b] = c;
+          from[k][b] = a;
+        }
+      }
+    }
+
+  bounds[CLASSES - 1] = limit;
+  for (int k = CLASSES - 1; k > 0; k--)
+    bounds[k - 1] = from[k][bounds[k]];
+}
+
+/* Sets the bounds to halves of the upper one, as many as fit. */
+static void powers_of_two(int *bounds) {
+  for (int i = CLASSES - 1, b = limit; i >= 0; i--, b /= 2)
+    bounds[i] = (b > i + 1) ? b : i + 1;
+  for (int i = 1; i < CLASSES; i++)
+    if (bounds[i] <= bounds[i - 1])
+      bounds[i] = bounds[i - 1] + 1;
+}
+
+/*
+ * write_header - Writes the bounds of the classes in bytes and the table of
+ *    classes by size in granules
+ */
+static void write_header(FILE *out, const int *bounds, const char *source) {
+  fprintf(out, "/*\n"
+               " * mm-classes.h - Size classes of the free lists of mm.c\n"
+               " *\n"
+               " * Generated by sizeclass from %s, don't edit.\n"
+               " */\n",
+          source);
+  fprintf(out, "#define CLASS_COUNT %d\n", CLASSES);
+  fprintf(out, "#define CLASS_GRANULES %d\n", limit);
+
+  fprintf(out, "#define CLASS_LIMITS {");
+  for (int i = 0; i < CLASSES; i++)
+    fprintf(out, "%s%d", i ? ", " : "", bounds[i] * GRANULE);
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "static const uint8_t size_class[CLASS_GRANULES + 1] = {");
+  for (int g = 0, i = 0; g <= limit; g++) {
+    while (g > bounds[i])
+      i++;
+    fprintf(out, "%s%d,", (g % 16) ? " " : "\n  ", i);
+  }
+  fprintf(out, "\n};\n");
+}
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv) {
+  FILE *out = stdout; /* the header (set by -o) */
+  int powers = 0;     /* powers of two instead of fitting (set by -p) */
+  int bounds[CLASSES];
+
+  char c;
+  while ((c = getopt(argc, argv, "m:o:w:hp")) != EOF) {
+    switch (c) {
+      case 'm': /* Upper bound of the last list */
+        limit = atoi(optarg) / GRANULE;
+        if (limit < CLASSES || limit > MAX_GRANULES)
+          app_error("the bound has to be in %d..%d bytes\n", CLASSES * GRANULE,
+                    MAX_LIMIT);
+        break;
+
+      case 'w': /* Weight of the search cost */
+        if ((lambda = atof(optarg)) < 0)
+          app_error("the weight can't be negative\n");
+        break;
+
+      case 'p': /* Write the powers of two */
+        powers = 1;
+        break;
+
+      case 'o': /* Write the header to a file */
+        if (!(out = fopen(optarg, "w")))
+          unix_error("Could not create %s", optarg);
+        break;
+
+      case 'h': /* Print this message */
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (powers == (optind < argc)) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  powers_of_two(bounds);
+  if (powers) {
+    write_header(out, bounds, "powers of two");
+  } else {
+    for (int i = optind; i < argc; i++)
+      read_trace(argv[i]);
+
+    for (int g = 1; g <= limit; g++) {
+      count[g] = count[g - 1] + hist[g];
+      volume[g] = volume[g - 1] + g * hist[g];
+    }
+    if (count[limit] == 0)
+      app_error("no blocks of up to %d bytes in the traces\n", limit * GRANULE);
+
+    double pow2 = total_cost(bounds);
+    fit(bounds);
+    fprintf(stderr, "cost %.4f, powers of two %.4f\n", total_cost(bounds),
+            pow2);
+
+    char source[MAXLINE];
+    snprintf(source, sizeof(source), "%d traces with -m %d -w %g",
+             argc - optind, limit * GRANULE, lambda);
+    write_header(out, bounds, source);
+  }
+
+  if (out != stdout && fclose(out) != 0)
+    unix_error("Could not write the header");
+  return EXIT_SUCCESS;
+}
+
+/*************************************
+ * Some miscellaneous helper routines
+ ************************************/
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * unix_error - Report the error and its errno.
+ */
+static void unix_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+  fprintf(stderr, "Usage: sizeclass [-h] [-m <bytes>] [-o <file>] "
+                  "[-w <weight>] <trace>...\n"
+                  "       sizeclass -p [-m <bytes>] [-o <file>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-m <bytes>  Upper bound of the last list, 4096 by "
+                  "default.\n");
+  fprintf(stderr, "\t-w <weight> Weight of the search cost against the "
+                  "waste, 1 by default.\n");
+  fprintf(stderr, "\t-p          Write powers of two instead of fitting "
+                  "them to traces.\n");
+  fprintf(stderr, "\t-o <file>   Write the header to <file>.\n");
+  fprintf(stderr, "\t-h          Print this message.\n");
+}
@@ -0,0 +1,25 @@
+/*
+ * trace.h - Records of the binary traces read by mdriver and sizeclass
+ */
+#include <stdint.h>
+
+/* Characterizes a single trace operation (allocator request), the fields
+   have fixed widths as the records of binary traces are used in place */
+enum { ALLOC, FREE, REALLOC };
+typedef struct {
+  uint32_t type; /* type of request */
+  int32_t index; /* index for free() to use later */
+  uint64_t size; /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Binary traces start with this header followed by num_ops traceop_t
+   records, the header keeps the records aligned */
+#define TRACE_MAGIC "mmtrace1"
+typedef struct {
+  char magic[8];
+  uint32_t weight;
+  uint32_t num_ids;
+  uint32_t num_ops;
+  uint32_t ignore_ranges;
+  uint64_t reserved;
+} trace_header_t;
@@ -0,0 +1,563 @@
+/*
+ * tracegen.c - Generates synthetic malloc traces for mdriver
+ *
+ * Objects are allocated one after another, their sizes and lifetimes are
+ * drawn from the given distributions. The time is counted in allocations, an
+ * object with lifetime l is freed right before allocation number t + l,
+ * where t is its own number. Some objects are resized on the way and the
+ * workload can change between phases, each phase has its own distributions.
+ *
+ * The output is a .rep trace: a header with the weight, the number of ids,
+ * the number of requests and the ignore-ranges flag, followed by one "a id
+ * size", "r id size" or "f id" line per request.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define MAXLINE 1024  /* max string size */
+#define MAX_PHASES 64 /* max number of -n options */
+#define MAX_HIST 4096 /* max number of values in a histogram */
+#define MAX_SIZE INT32_MAX /* mdriver reads sizes as ints */
+#define MAX_LIFETIME INT32_MAX /* outlives any trace, the ids are ints */
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* A distribution of sizes or lifetimes given on the command line */
+typedef struct {
+  enum { CONST, UNIFORM, EXP, PARETO, LOGNORMAL, GEN, HIST } kind;
+  double a, b, c;   /* parameters, depend on the kind */
+  int count;        /* number of values in the histogram */
+  double *values;   /* values of the histogram... */
+  double *weights;  /* ... and the sum of weights up to each of them */
+} dist_t;
+
+/* Describes one phase of the workload */
+typedef struct {
+  long allocs;     /* number of objects allocated in the phase */
+  dist_t size;     /* sizes of the objects */
+  dist_t lifetime; /* lifetimes of the objects in allocations */
+  double resize;   /* fraction of objects that get resized */
+  double factor;   /* each resize multiplies the size by that */
+  int resizes;     /* number of resizes of such an object */
+} phase_t;
+
+/* A request scheduled for some time, kept in a binary heap */
+typedef struct {
+  uint64_t time; /* allocation number it goes before */
+  uint64_t seq;  /* order of scheduling, breaks the ties */
+  int id;        /* the object */
+  int resize;    /* is it a resize or a free */
+} event_t;
+
+/* The objects, only their current sizes matter */
+typedef struct {
+  size_t size;   /* current size */
+  double factor; /* multiplies the size on every resize */
+} object_t;
+
+/********************
+ * Global variables
+ *******************/
+
+static uint64_t rng_state = 1; /* set by -S */
+
+static event_t *events;     /* heap of the scheduled requests */
+static size_t num_events;   /* number of requests in the heap */
+static size_t max_events;   /* room in the heap */
+static uint64_t event_seq;  /* requests scheduled so far */
+
+static object_t *objects;  /* all objects, indexed by their id */
+static size_t live_bytes;  /* sum of the sizes of the live objects */
+static size_t peak_bytes;  /* the most live bytes at any time */
+static size_t live_cap;    /* limit of live bytes, 0 if none (set by -c) */
+
+static FILE *body;   /* requests are written here before the header */
+static long num_ops; /* number of requests written */
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void usage(void);
+static void app_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+static void unix_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+
+/*****************
+ * Random numbers
+ *****************/
+
+/* rng_next - xorshift64* generator, returns 64 random bits */
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* rng_unit - uniform double in (0, 1) */
+static double rng_unit(void) {
+  return ((rng_next() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* rng_normal - standard normal variable (Box-Muller) */
+static double rng_normal(void) {
+  return sqrt(-2.0 * log(rng_unit())) * cos(2.0 * M_PI * rng_unit());
+}
+
+/****************
+ * Distributions
+ ****************/
+
+/*
+ * read_hist - read a histogram as "value weight" lines from a file or as
+ *     a list of value=weight pairs separated by commas
+ */
+static void read_hist(dist_t *d, const char *spec) {
+  FILE *file = NULL;
+  char line[MAXLINE];
+  const char *p = spec;
+
+  if (spec[0] == '@' && !(file = fopen(spec + 1, "r")))
+    unix_error("Could not open %s", spec + 1);
+
+  d->values = malloc(MAX_HIST * sizeof(double));
+  d->weights = malloc(MAX_HIST * sizeof(double));
+  if (!d->values || !d->weights)
+    unix_error("malloc failed in read_hist");
+
+  double sum = 0, value, weight;
+  for (d->count = 0;; d->count++) {
+    int n;
+    if (file) {
+      if (!fgets(line, sizeof(line), file))
+        break;
+      if (sscanf(line, "%lf %lf", &value, &weight) != 2)
+        continue;
+    } else {
+      if (*p == '\0')
+        break;
+      if (sscanf(p, "%lf=%lf%n", &value, &weight, &n) != 2)
+        app_error("bad histogram %s\n", spec);
+      p += n + (p[n] == ',');
+    }
+    if (d->count == MAX_HIST)
+      app_error("more than %d values in histogram %s\n", MAX_HIST, spec);
+    if (weight < 0)
+      app_error("negative weight in histogram %s\n", spec);
+    d->values[d->count] = value;
+    d->weights[d->count] = (sum += weight);
+  }
+
+  if (file)
+    fclose(file);
+  if (d->count == 0 || sum <= 0)
+    app_error("empty histogram %s\n", spec);
+}
+
+/*
+ * parse_dist - parse a distribution given as kind:param:param...
+ */
+static void parse_dist(dist_t *d, const char *spec) {
+  memset(d, 0, sizeof(*d));
+
+  if (sscanf(spec, "const:%lf", &d->a) == 1) {
+    d->kind = CONST;
+  } else if (sscanf(spec, "uniform:%lf:%lf", &d->a, &d->b) == 2) {
+    d->kind = UNIFORM;
+  } else if (sscanf(spec, "exp:%lf", &d->a) == 1) {
+    d->kind = EXP;
+  } else if (sscanf(spec, "pareto:%lf:%lf:%lf", &d->a, &d->b, &d->c) >= 2) {
+    d->kind = PARETO;
+  } else if (sscanf(spec, "lognormal:%lf:%lf", &d->a, &d->b) == 2) {
+    d->kind = LOGNORMAL;
+  } else if (sscanf(spec, "gen:%lf:%lf:%lf", &d->a, &d->b, &d->c) == 3) {
+    d->kind = GEN;
+  } else if (strncmp(spec, "hist:", 5) == 0) {
+    d->kind = HIST;
+    read_hist(d, spec + 5);
+  } else {
+    app_error("bad distribution %s\n", spec);
+  }
+
+  /* bounds given the other way round would fall outside of the range */
+  if (d->kind == UNIFORM && d->b < d->a)
+    app_error("the upper bound of %s has to be at least %g\n", spec, d->a);
+  if (d->kind == PARETO && d->c > 0 && d->c < d->a)
+    app_error("the maximum of %s has to be at least %g\n", spec, d->a);
+  if (d->kind == PARETO && !(d->b > 0))
+    app_error("the tail index of %s has to be positive\n", spec);
+}
+
+/*
+ * sample - draw a value from the distribution
+ */
+static double sample(const dist_t *d) {
+  double x;
+
+  switch (d->kind) {
+    case CONST:
+      return d->a;
+
+    case UNIFORM: /* integers from a to b */
+      return floor(d->a + rng_unit() * (d->b - d->a + 1));
+
+    case EXP: /* mean a */
+      return -d->a * log(rng_unit());
+
+    case PARETO: /* minimum a, tail index b, cut at c if given */
+      x = d->a / pow(rng_unit(), 1.0 / d->b);
+      return (d->c > 0 && x > d->c) ? d->c : x;
+
+    case LOGNORMAL: /* median a, sigma b */
+      return d->a * exp(d->b * rng_normal());
+
+    case GEN: /* fraction a die young with mean b, the rest with mean c */
+      return -((rng_unit() < d->a) ? d->b : d->c) * log(rng_unit());
+
+    case HIST: {
+      double r = rng_unit() * d->weights[d->count - 1];
+      int lo = 0, hi = d->count - 1;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (d->weights[mid] < r)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return d->values[lo];
+    }
+  }
+  return 0;
+}
+
+/********************
+ * Scheduled requests
+ ********************/
+
+/* event_before - is event a due before event b */
+static int event_before(const event_t *a, const event_t *b) {
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+/*
+ * schedule - put the request into the heap
+ */
+static void schedule(uint64_t time, int id, int resize) {
+  if (num_events == max_events) {
+    max_events = max_events ? 2 * max_events : 1024;
+    if (!(events = realloc(events, max_events * sizeof(event_t))))
+      unix_error("realloc failed in schedule");
+  }
+
+  event_t e = {time, event_seq++, id, resize};
+  size_t i = num_events++;
+  while (i > 0 && event_before(&e, &events[(i - 1) / 2])) {
+    events[i] = events[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  events[i] = e;
+}
+
+/*
+ * next_event - take the earliest request out of the heap
+ */
+static event_t next_event(void) {
+  event_t top = events[0];
+  event_t last = events[--num_events];
+  size_t i = 0;
+
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= num_events)
+      break;
+    if (child + 1 < num_events &&
+        event_before(&events[child + 1], &events[child]))
+      child++;
+    if (!event_before(&events[child], &last))
+      break;
+    events[i] = events[child];
+    i = child;
+  }
+  if (num_events > 0)
+    events[i] = last;
+  return top;
+}
+
+/*
+ * emit - write out the request that is due and update the live bytes
+ */
+static void emit(event_t e) {
+  object_t *obj = &objects[e.id];
+
+  if (e.resize) {
+    double grown = obj->size * obj->factor + 0.5;
+    size_t size = (grown < 1) ? 1 : (grown > MAX_SIZE) ? MAX_SIZE : grown;
+    live_bytes += size - obj->size;
+    obj->size = size;
+    fprintf(body, "r %d %zu\n", e.id, size);
+  } else {
+    live_bytes -= obj->size;
+    fprintf(body, "f %d\n", e.id);
+  }
+  num_ops++;
+}
+
+/*
+ * enforce_cap - free objects ahead of time, in the order they would die,
+ *     until the live bytes fit under the cap
+ */
+static void enforce_cap(void) {
+  while (live_cap && live_bytes > live_cap && num_events > 0)
+    emit(next_event());
+}
+
+/*********************
+ * Generating a trace
+ *********************/
+
+/*
+ * generate - allocate all objects of all phases, freeing and resizing them
+ *     as their requests get due
+ */
+static void generate(phase_t *phases, int num_phases, long num_ids, int keep) {
+  uint64_t now = 0;
+
+  if (!(objects = calloc(num_ids, sizeof(object_t))))
+    unix_error("calloc failed in generate");
+
+  for (int i = 0; i < num_phases; i++) {
+    phase_t *ph = &phases[i];
+
+    for (long k = 0; k < ph->allocs; k++, now++) {
+      while (num_events > 0 && events[0].time <= now)
+        emit(next_event());
+
+      int id = now;
+      double size = sample(&ph->size);
+      double lifetime = sample(&ph->lifetime);
+
+      object_t *obj = &objects[id];
+      obj->size = (size < 1) ? 1 : (size > MAX_SIZE) ? MAX_SIZE : size;
+      obj->factor = ph->factor;
+      live_bytes += obj->size;
+      fprintf(body, "a %d %zu\n", id, obj->size);
+      num_ops++;
+
+      /* dies before the allocation after its lifetime, resizes on the way */
+      uint64_t life = (lifetime > 0) ? fmin(lifetime, MAX_LIFETIME) : 0;
+      uint64_t death = now + 1 + life;
+      if (ph->resizes > 0 && rng_unit() < ph->resize) {
+        for (int j = 0; j < ph->resizes; j++)
+          schedule(now + 1 + (uint64_t)(rng_unit() * (death - now - 1)), id,
+                   1);
+      }
+      schedule(death, id, 0);
+
+      if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+      enforce_cap();
+    }
+  }
+
+  /* the objects still live at the end are freed unless asked not to */
+  while (num_events > 0) {
+    event_t e = next_event();
+    if (!keep || e.resize)
+      emit(e);
+  }
+}
+
+/*
+ * write_trace - write the header and copy the requests after it
+ */
+static void write_trace(FILE *out, int weight, long num_ids, int ignore) {
+  char buf[1 << 16];
+  size_t n;
+
+  fprintf(out, "%d\n%ld\n%ld\n%d\n", weight, num_ids, num_ops, ignore);
+  rewind(body);
+  while ((n = fread(buf, 1, sizeof(buf), body)) > 0)
+    if (fwrite(buf, 1, n, out) != n)
+      unix_error("Could not write the trace");
+  fclose(body);
+}
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv) {
+  phase_t phases[MAX_PHASES]; /* phases given by -n */
+  int num_phases = 0;
+  phase_t current = {0};      /* settings of the next phase */
+  FILE *out = stdout;         /* the trace (set by -o) */
+  int weight = 1;             /* weight in the header (set by -w) */
+  int ignore = 0;             /* no range checks (set by -i) */
+  int keep = 0;               /* leave objects live at the end (set by -k) */
+
+  parse_dist(&current.size, "uniform:1:256");
+  parse_dist(&current.lifetime, "exp:1000");
+  current.factor = 2.0;
+  current.resizes = 1;
+
+  /*
+   * Read and interpret the command line arguments, every -n ends a phase
+   * with the options given before it
+   */
+  char c;
+  while ((c = getopt(argc, argv, "c:l:n:o:r:s:S:w:hik")) != EOF) {
+    switch (c) {
+      case 's': /* Sizes of the objects */
+        parse_dist(&current.size, optarg);
+        break;
+
+      case 'l': /* Lifetimes of the objects */
+        parse_dist(&current.lifetime, optarg);
+        break;
+
+      case 'r': /* Resize some objects */
+        if (sscanf(optarg, "%lf:%lf:%d", &current.resize, &current.factor,
+                   &current.resizes) < 2 ||
+            current.resize < 0 || current.resize > 100 || current.resizes < 0)
+          app_error("bad resizes %s\n", optarg);
+        current.resize /= 100;
+        break;
+
+      case 'n': /* Allocate that many objects with the settings so far */
+        if (num_phases == MAX_PHASES)
+          app_error("more than %d phases\n", MAX_PHASES);
+        if ((current.allocs = atol(optarg)) < 0)
+          app_error("the number of objects can't be negative\n");
+        phases[num_phases++] = current;
+        break;
+
+      case 'c': /* Limit the live bytes */
+        live_cap = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'S': /* Seed of the random generator */
+        rng_state = strtoull(optarg, NULL, 0) | 1;
+        break;
+
+      case 'o': /* Write the trace to a file */
+        if (!(out = fopen(optarg, "w")))
+          unix_error("Could not create %s", optarg);
+        break;
+
+      case 'w': /* Weight of the trace */
+        weight = atoi(optarg);
+        break;
+
+      case 'i': /* Tell mdriver not to check the ranges */
+        ignore = 1;
+        break;
+
+      case 'k': /* Don't free the objects live at the end */
+        keep = 1;
+        break;
+
+      case 'h': /* Print this message */
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (num_phases == 0 || optind != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  long num_ids = 0;
+  for (int i = 0; i < num_phases; i++)
+    num_ids += phases[i].allocs;
+  if (num_ids == 0 || num_ids > INT32_MAX)
+    app_error("the number of objects has to be in 1..%d\n", INT32_MAX);
+
+  if (!(body = tmpfile()))
+    unix_error("Could not create a temporary file");
+  generate(phases, num_phases, num_ids, keep);
+  write_trace(out, weight, num_ids, ignore);
+  if (out != stdout && fclose(out) != 0)
+    unix_error("Could not write the trace");
+
+  fprintf(stderr, "%ld objects, %ld requests, %zu bytes live at peak\n",
+          num_ids, num_ops, peak_bytes);
+  return EXIT_SUCCESS;
+}
+
+/*************************************
+ * Some miscellaneous helper routines
+ ************************************/
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * unix_error - Report the error and its errno.
+ */
+static void unix_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+  fprintf(stderr, "Usage: tracegen [-hik] [-c <bytes>] [-o <file>] [-S <seed>] "
+                  "[-w <i>]\n"
+                  "                [[-s <dist>] [-l <dist>] [-r <spec>] "
+                  "-n <count>]...\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-s <dist>  Sizes of the objects in bytes.\n");
+  fprintf(stderr, "\t-l <dist>  Lifetimes of the objects in allocations.\n");
+  fprintf(stderr, "\t-r <pct>:<factor>[:<n>]\n"
+                  "\t           Resize <pct>%% of objects <n> times, "
+                  "by <factor> each time.\n");
+  fprintf(stderr, "\t-n <count> Allocate <count> objects with the options "
+                  "given so far.\n");
+  fprintf(stderr, "\t-c <bytes> Free objects early to keep at most <bytes> "
+                  "live.\n");
+  fprintf(stderr, "\t-k         Don't free the objects live at the end.\n");
+  fprintf(stderr, "\t-i         Set the ignore-ranges flag of the trace.\n");
+  fprintf(stderr, "\t-w <i>     Set the weight of the trace to <i>.\n");
+  fprintf(stderr, "\t-S <seed>  Seed the random generator.\n");
+  fprintf(stderr, "\t-o <file>  Write the trace to <file>.\n");
+  fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "Distributions\n");
+  fprintf(stderr, "\tconst:<v>, uniform:<lo>:<hi>, exp:<mean>,\n");
+  fprintf(stderr, "\tpareto:<min>:<alpha>[:<max>], lognormal:<median>:<sigma>,"
+                  "\n");
+  fprintf(stderr, "\tgen:<young fraction>:<young mean>:<old mean>,\n");
+  fprintf(stderr, "\thist:<v>=<weight>,... or hist:@<file> with <v> <weight> "
+                  "lines.\n");
+}